@@ -0,0 +1,96 @@
+#!/usr/bin/python -tt
+
+## Client of fence_agentd
+##
+## fence_agentc AGENT [options] runs a fence agent in fence_agentd with the
+## given options or, without options, with the name=value lines read from
+## standard input, exactly as the agent itself would take them. The output
+## and the exit code of the agent are passed on. When no server is running,
+## the agent is run directly.
+##
+## A link named after an agent runs that agent, e.g. fence_ipmilan -> fence_agentc.
+##
+## Keep this client small, it imports neither the fencing library nor the agent.
+
+import sys, os, socket
+
+#BEGIN_VERSION_GENERATION
+RELEASE_VERSION=""
+REDHAT_COPYRIGHT=""
+BUILD_DATE=""
+#END_VERSION_GENERATION
+
+AGENT_DIR = "@SBINDIR@"
+SOCKET_PATH = "@CLUSTERVARRUN@/fence_agentd.sock"
+
+def usage():
+	print "Usage: fence_agentc AGENT [agent options]"
+	print "Runs a fence agent in fence_agentd, the agent reads standard input when"
+	print "no options are given. FENCE_AGENTD_SOCKET overrides the socket path"
+	print "(default " + SOCKET_PATH + ")."
+
+## Run the agent without the server, the request may already hold standard input
+######
+def run_agent(name, args, stdin):
+	path = os.path.join(AGENT_DIR, name)
+	if os.path.realpath(path) == os.path.realpath(sys.argv[0]):
+		sys.stderr.write("fence_agentd is not running and %s is a link to fence_agentc\n" % path)
+		sys.exit(1)
+
+	if len(args) == 0:
+		(pipe_in, pipe_out) = os.pipe()
+		if os.fork() == 0:
+			os.close(pipe_in)
+			while len(stdin) > 0:
+				stdin = stdin[os.write(pipe_out, stdin):]
+			os._exit(0)
+		os.close(pipe_out)
+		os.dup2(pipe_in, 0)
+		os.close(pipe_in)
+
+	try:
+		os.execv(path, [path] + args)
+	except OSError, ex:
+		sys.stderr.write("Unable to run %s: %s\n" % (path, ex.strerror))
+		sys.exit(1)
+
+def main():
+	name = os.path.basename(sys.argv[0])
+	args = sys.argv[1:]
+
+	if name in ["fence_agentc", "fence_agentc.py"]:
+		if len(args) == 0 or args[0] in ["-h", "--help"]:
+			usage()
+			sys.exit(len(args) == 0 and 1 or 0)
+		name = args.pop(0)
+
+	## like process_input(), the agent reads standard input only without options
+	stdin = ""
+	if len(args) == 0:
+		stdin = sys.stdin.read()
+
+	conn = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+	try:
+		conn.connect(os.environ.get("FENCE_AGENTD_SOCKET", SOCKET_PATH))
+		conn.sendall("\0".join([name, str(len(args))] + args + [stdin]))
+		conn.shutdown(socket.SHUT_WR)
+	except socket.error:
+		conn.close()
+		run_agent(name, args, stdin)
+
+	reply = conn.makefile("rb")
+	while True:
+		header = reply.readline().split()
+		if len(header) != 2:
+			sys.stderr.write("Connection to fence_agentd lost\n")
+			sys.exit(1)
+
+		if header[0] == "exit":
+			sys.exit(int(header[1]))
+
+		stream = header[0] == "1" and sys.stdout or sys.stderr
+		stream.write(reply.read(int(header[1])))
+		stream.flush()
+
+if __name__ == "__main__":
+	main()
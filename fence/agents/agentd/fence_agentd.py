@@ -0,0 +1,328 @@
+#!/usr/bin/python -tt
+
+## Resident server for the python fence agents
+##
+## fence_agentd imports the preloaded agents once and forks a worker for each
+## connection on its UNIX socket. The worker reads the request and runs main()
+## of the agent with its arguments and standard input, so a stonith operation
+## no longer pays for starting the interpreter and importing the agent, the
+## fencing library, pexpect, pycurl or suds. An agent which was not preloaded
+## is imported by the worker of every request for it.
+##
+## Request:	"<agent>\0<number of arguments>\0<argument>\0...\0<standard input>",
+##		terminated by shutting down the sending side
+## Response:	"<stream> <length>\n<data>" for stream 1 (stdout) and 2 (stderr),
+##		followed by "exit <code>\n"
+
+import sys, os, socket, signal, select, getopt, imp, re, errno, threading, traceback, logging
+from StringIO import StringIO
+sys.path.append("@FENCEAGENTSLIBDIR@")
+from fencing import SyslogLibHandler
+
+#BEGIN_VERSION_GENERATION
+RELEASE_VERSION=""
+REDHAT_COPYRIGHT=""
+BUILD_DATE=""
+#END_VERSION_GENERATION
+
+AGENT_DIR = "@SBINDIR@"
+SOCKET_PATH = "@CLUSTERVARRUN@/fence_agentd.sock"
+
+## seconds a client has to send its request, and the largest request taken
+REQUEST_TIMEOUT = 5
+REQUEST_MAX = 1024 * 1024
+
+AGENT_RE = re.compile(r"^fence_[a-z0-9_]+$")
+
+## agents imported so far, name -> (path, module)
+agents = {}
+
+class StreamWriter(object):
+	"""
+	File object which passes everything written to it to the client in frames
+	"""
+	def __init__(self, conn, stream):
+		self.conn = conn
+		self.stream = stream
+		self.softspace = 0
+
+	def write(self, data):
+		if isinstance(data, unicode):
+			data = data.encode("utf-8")
+		if len(data) == 0:
+			return
+		try:
+			self.conn.sendall("%s %d\n%s" % (self.stream, len(data), data))
+		except socket.error:
+			## the client is gone (e.g. killed on timeout), so is the agent
+			os.killpg(0, signal.SIGKILL)
+
+	def writelines(self, lines):
+		for line in lines:
+			self.write(line)
+
+	def flush(self):
+		pass
+
+	def close(self):
+		pass
+
+	def isatty(self):
+		return False
+
+def usage():
+	print "Usage: fence_agentd [options]"
+	print "Options:"
+	print "   -s, --socket=[path]            UNIX socket to serve (default " + SOCKET_PATH + ")"
+	print "   -d, --agent-dir=[path]         Directory of the fence agents (default " + AGENT_DIR + ")"
+	print "   -p, --preload=[agent,...]      Import these agents at start"
+	print "   -v, --verbose                  Log every request"
+	print "   -V, --version                  Display version information and exit"
+	print "   -h, --help                     Display this help and exit"
+
+def load_agent(agent_dir, name):
+	if agents.has_key(name):
+		return agents[name]
+
+	if AGENT_RE.match(name) is None or name in ["fence_agentd", "fence_agentc"]:
+		raise ImportError("%s is not a fence agent" % name)
+
+	path = os.path.join(agent_dir, name)
+	if os.path.basename(os.path.realpath(path)) in ["fence_agentd", "fence_agentc"]:
+		raise ImportError("%s is a link to the fence_agentd client" % path)
+
+	with open(path) as agent_file:
+		if agent_file.readline().find("python") == -1:
+			raise ImportError("%s is not a python fence agent" % path)
+
+	agents[name] = (path, imp.load_source(name, path))
+	logging.info("Imported %s\n", path)
+	return agents[name]
+
+def read_request(conn):
+	data = []
+	size = 0
+	while True:
+		chunk = conn.recv(65536)
+		if len(chunk) == 0:
+			break
+		size += len(chunk)
+		if size > REQUEST_MAX:
+			raise ValueError("request is larger than %d bytes" % REQUEST_MAX)
+		data.append(chunk)
+
+	fields = "".join(data).split("\0")
+	if len(fields) < 3:
+		raise ValueError("malformed request")
+	argc = int(fields[1])
+	if len(fields) < argc + 3:
+		raise ValueError("malformed request")
+
+	return (fields[0], fields[2:argc + 2], "\0".join(fields[argc + 2:]))
+
+def exit_code(code, stderr):
+	if code is None:
+		return 0
+	if isinstance(code, (int, long)):
+		return code
+	stderr.write("%s\n" % code)
+	return 1
+
+## Kill the worker and the commands of the agent once the client hangs up
+##	Run directly, the agent dies when it is killed on the stonith timeout, it
+##	must not go on switching the device after the client is gone either.
+######
+def watch_client(conn):
+	poller = select.poll()
+	poller.register(conn.fileno(), select.POLLHUP)
+	while True:
+		try:
+			if len(poller.poll()) > 0:
+				break
+		except select.error, ex:
+			if ex.args[0] != errno.EINTR:
+				break
+	os.killpg(0, signal.SIGKILL)
+
+## Run the agent in the worker, the server keeps no state of a request
+######
+def serve_request(conn, path, module, args, stdin):
+	conn.settimeout(None)
+
+	watcher = threading.Thread(target=watch_client, args=(conn,))
+	watcher.daemon = True
+	watcher.start()
+
+	## the agent sets up its own logging in check_input()
+	logging.getLogger().handlers = []
+	logging.getLogger().setLevel(logging.WARNING)
+
+	stdout = StreamWriter(conn, "1")
+	stderr = StreamWriter(conn, "2")
+	sys.argv = [path] + args
+	sys.stdin = StringIO(stdin)
+	sys.stdout = stdout
+	sys.stderr = stderr
+
+	try:
+		module.main()
+		code = 0
+	except SystemExit, ex:
+		code = exit_code(ex.code, stderr)
+	except Exception:
+		stderr.write(traceback.format_exc())
+		code = 1
+
+	try:
+		conn.sendall("exit %d\n" % code)
+	except socket.error:
+		pass
+
+## Read the request and run the agent in a worker forked from the server
+##
+## The request is read and the agent imported only after the fork, so a slow
+## or stuck client and the import of an agent which was not preloaded never
+## keep the server from accepting the next request.
+######
+def handle_request(conn, agent_dir, verbose):
+	## the commands the agent runs are killed along with the worker
+	os.setpgid(0, 0)
+	signal.signal(signal.SIGCHLD, signal.SIG_DFL)
+	signal.signal(signal.SIGTERM, signal.SIG_DFL)
+	signal.signal(signal.SIGINT, signal.SIG_DFL)
+
+	conn.settimeout(REQUEST_TIMEOUT)
+	try:
+		(name, args, stdin) = read_request(conn)
+		(path, module) = load_agent(agent_dir, name)
+	except (socket.error, ValueError, ImportError, IOError), ex:
+		logging.error("Request failed: %s\n", str(ex))
+		try:
+			conn.sendall("2 %d\n%s" % (len(str(ex)) + 1, str(ex) + "\n"))
+			conn.sendall("exit 1\n")
+		except socket.error:
+			pass
+		return
+	except Exception:
+		logging.error("Request failed: %s\n", traceback.format_exc())
+		return
+
+	if verbose:
+		logging.info("Running %s %s\n", name, " ".join(args))
+
+	serve_request(conn, path, module, args, stdin)
+
+def handle_connection(sock, conn, agent_dir, verbose):
+	try:
+		pid = os.fork()
+	except OSError, ex:
+		logging.error("Unable to fork: %s\n", str(ex))
+		return
+
+	if pid == 0:
+		try:
+			sock.close()
+			handle_request(conn, agent_dir, verbose)
+		finally:
+			os._exit(0)
+
+def open_socket(path):
+	sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+
+	## refuse to take the socket of a running server, remove a stale one
+	try:
+		sock.connect(path)
+		logging.error("fence_agentd is already serving %s\n", path)
+		sys.exit(1)
+	except socket.error, ex:
+		if ex.errno == errno.ECONNREFUSED:
+			os.unlink(path)
+	sock.close()
+
+	sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+	old_umask = os.umask(0177)
+	try:
+		sock.bind(path)
+	finally:
+		os.umask(old_umask)
+	sock.listen(64)
+	return sock
+
+def stop_server(signum, frame):
+	del signum, frame
+	sys.exit(0)
+
+def main():
+	socket_path = SOCKET_PATH
+	agent_dir = AGENT_DIR
+	preload = []
+	verbose = False
+
+	logging.getLogger().setLevel(logging.INFO)
+	logging.getLogger().addHandler(SyslogLibHandler())
+	logging.getLogger().addHandler(logging.StreamHandler(stream=sys.stderr))
+
+	try:
+		(opts, _args) = getopt.gnu_getopt(sys.argv[1:], "s:d:p:vVh", \
+				["socket=", "agent-dir=", "preload=", "verbose", "version", "help"])
+	except getopt.GetoptError, error:
+		logging.error("%s\n", error.msg)
+		usage()
+		sys.exit(1)
+
+	for (name, value) in opts:
+		if name in ["-s", "--socket"]:
+			socket_path = value
+		elif name in ["-d", "--agent-dir"]:
+			agent_dir = value
+		elif name in ["-p", "--preload"]:
+			preload.extend([x for x in value.split(",") if len(x) > 0])
+		elif name in ["-v", "--verbose"]:
+			verbose = True
+		elif name in ["-V", "--version"]:
+			print RELEASE_VERSION, BUILD_DATE
+			print REDHAT_COPYRIGHT
+			sys.exit(0)
+		elif name in ["-h", "--help"]:
+			usage()
+			sys.exit(0)
+
+	## agents are compiled when imported, do not leave "fence_xyzc" files next to them
+	sys.dont_write_bytecode = True
+
+	for name in preload:
+		try:
+			load_agent(agent_dir, name)
+		except Exception, ex:
+			logging.error("Unable to import %s: %s\n", name, str(ex))
+			sys.exit(1)
+
+	## workers are reaped by the kernel
+	signal.signal(signal.SIGCHLD, signal.SIG_IGN)
+	signal.signal(signal.SIGTERM, stop_server)
+	signal.signal(signal.SIGINT, stop_server)
+
+	sock = open_socket(socket_path)
+	logging.info("Serving %s\n", socket_path)
+
+	try:
+		while True:
+			try:
+				(conn, _addr) = sock.accept()
+			except socket.error, ex:
+				if ex.errno == errno.EINTR:
+					continue
+				raise
+			try:
+				handle_connection(sock, conn, agent_dir, verbose)
+			finally:
+				conn.close()
+	finally:
+		sock.close()
+		try:
+			os.unlink(socket_path)
+		except OSError:
+			pass
+
+if __name__ == "__main__":
+	main()
@@ -71,7 +71,7 @@ the specified Blade Server."
 	show_docs(options, docs)
 
 	# Operate the fencing device
-	result = fence_action(FencingSnmp(options), options, set_power_status, get_power_status, get_outlets_status)
+	result = fence_action(FencingSnmp(options, thread_safe=True), options, set_power_status, get_power_status, get_outlets_status)
 
 	sys.exit(result)
 if __name__ == "__main__":
@@ -84,7 +84,7 @@ for command line and snmp_version option for your cluster.conf."
 	show_docs(options, docs)
 
 	# Operate the fencing device
-	result = fence_action(FencingSnmp(options), options, set_power_status, get_power_status, get_outlets_status)
+	result = fence_action(FencingSnmp(options, thread_safe=True), options, set_power_status, get_power_status, get_outlets_status)
 
 	sys.exit(result)
 
@@ -30,15 +30,103 @@
 #include <ctype.h>
 #include <errno.h>
 #include <netdb.h>
+#include <time.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <net/if.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
 
 #include "options.h"
 #include "message.h"
+#include "hmac.h"
 #include "version.h"
 
+#define FENCE_KDUMP_MAX_EVENTS 8
+#define FENCE_KDUMP_MAX_PEERS  1024
+#define FENCE_KDUMP_QUERY_LEN  128
+#define FENCE_KDUMP_NODE_DELIM ", \t"
+#define FENCE_KDUMP_FILTER_LEN BPF_MAXINSNS
+#define FENCE_KDUMP_BATCH_LEN  64
+#define FENCE_KDUMP_RETRY_WAIT 10
+#define FENCE_KDUMP_QUERY_WAIT 2
+
+#define BPF_INSN(code, k, jt, jf) \
+    ((struct sock_filter) { (code), (jt), (jf), (k) })
+
+enum {
+    FENCE_KDUMP_CONN_CLOSED = 0,
+    FENCE_KDUMP_CONN_UDP    = 1,
+    FENCE_KDUMP_CONN_QUERY  = 2,
+    FENCE_KDUMP_CONN_CLIENT = 3,
+};
+
+typedef struct fence_kdump_peer {
+    fence_kdump_addr_t ip;
+    struct timespec stamp;
+    fence_kdump_msg_t msg;
+    unsigned int count;
+    unsigned int discarded;
+    struct list_head list;
+} fence_kdump_peer_t;
+
+typedef struct fence_kdump_conn {
+    int fd;
+    int kind;
+    int waiting;
+    size_t len;
+    char buf[FENCE_KDUMP_QUERY_LEN];
+    char addr[FENCE_KDUMP_ADDR_LEN];
+    fence_kdump_addr_t ip;
+    struct timespec deadline;
+    struct list_head list;
+} fence_kdump_conn_t;
+
+typedef struct fence_kdump_batch {
+    int count;
+    struct mmsghdr hdr[FENCE_KDUMP_BATCH_LEN];
+    struct iovec iov[FENCE_KDUMP_BATCH_LEN];
+    struct sockaddr_storage ss[FENCE_KDUMP_BATCH_LEN];
+    fence_kdump_addr_t ip[FENCE_KDUMP_BATCH_LEN];
+    fence_kdump_msg_t msg[FENCE_KDUMP_BATCH_LEN];
+    struct timespec ts[FENCE_KDUMP_BATCH_LEN];
+    char ctrl[FENCE_KDUMP_BATCH_LEN][CMSG_SPACE (sizeof (struct timespec))];
+} fence_kdump_batch_t;
+
+typedef struct fence_kdump_stats {
+    struct timespec start;
+    struct timespec resolved;
+    struct timespec binding;
+    struct timespec bound;
+    struct timespec first_packet;
+    struct timespec first_valid;
+    unsigned int packets;
+    unsigned int valid;
+    unsigned int discarded;
+    unsigned int bad_magic;
+    unsigned int bad_version;
+    unsigned int bad_length;
+    unsigned int bad_auth;
+    unsigned int kernel_drops;
+} fence_kdump_stats_t;
+
 static int verbose = 0;
 
+static volatile sig_atomic_t terminate = 0;
+
+static uint8_t key[FENCE_KDUMP_KEY_MAX];
+static size_t keylen = 0;
+
+/* wall clock, to compare with the kernel receive timestamps */
+static fence_kdump_stats_t stats;
+
 #define log_debug(lvl, fmt, args...)               \
 do {                                               \
     if (lvl <= verbose) {                          \
@@ -81,92 +169,1535 @@ trim (char *str)
 }
 
 static int
-read_message (const fence_kdump_node_t *node, void *msg, int len)
+set_addr (fence_kdump_addr_t *ip, const struct sockaddr *sa)
+{
+    const struct sockaddr_in *sin = (const struct sockaddr_in *) sa;
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) sa;
+
+    memset (ip, 0, sizeof (*ip));
+
+    switch (sa->sa_family) {
+    case AF_INET:
+        ip->family = AF_INET;
+        memcpy (ip->data, &sin->sin_addr, sizeof (sin->sin_addr));
+        return (0);
+    case AF_INET6:
+        /* ipv4-mapped addresses are the same node as plain ipv4 ones */
+        if (IN6_IS_ADDR_V4MAPPED (&sin6->sin6_addr)) {
+            ip->family = AF_INET;
+            memcpy (ip->data, &sin6->sin6_addr.s6_addr[12], 4);
+        } else {
+            ip->family = AF_INET6;
+            memcpy (ip->data, &sin6->sin6_addr, sizeof (sin6->sin6_addr));
+        }
+        return (0);
+    default:
+        return (1);
+    }
+}
+
+static int
+parse_addr (fence_kdump_addr_t *ip, const char *str, int family)
+{
+    struct sockaddr_in sin;
+    struct sockaddr_in6 sin6;
+
+    memset (&sin, 0, sizeof (sin));
+    memset (&sin6, 0, sizeof (sin6));
+
+    sin.sin_family = AF_INET;
+    sin6.sin6_family = AF_INET6;
+
+    if ((family != AF_INET6) && (inet_pton (AF_INET, str, &sin.sin_addr) == 1)) {
+        return (set_addr (ip, (struct sockaddr *) &sin));
+    }
+    if ((family != AF_INET) && (inet_pton (AF_INET6, str, &sin6.sin6_addr) == 1)) {
+        return (set_addr (ip, (struct sockaddr *) &sin6));
+    }
+
+    return (1);
+}
+
+static int
+is_multicast (const fence_kdump_addr_t *ip)
+{
+    if (ip->family == AF_INET) {
+        return ((ip->data[0] & 0xF0) == 0xE0);
+    }
+
+    return (ip->data[0] == 0xFF);
+}
+
+static const char *
+format_addr (const fence_kdump_addr_t *ip, char *str, size_t len)
+{
+    if (inet_ntop (ip->family, ip->data, str, len) == NULL) {
+        snprintf (str, len, "?");
+    }
+
+    return (str);
+}
+
+static fence_kdump_batch_t *
+alloc_batch (void)
+{
+    int i;
+    fence_kdump_batch_t *batch;
+
+    batch = malloc (sizeof (fence_kdump_batch_t));
+    if (!batch) {
+        log_error (2, "malloc (%s)\n", strerror (errno));
+        return (NULL);
+    }
+
+    memset (batch, 0, sizeof (fence_kdump_batch_t));
+
+    /* the slots are set up once and reused for every receive */
+    for (i = 0; i < FENCE_KDUMP_BATCH_LEN; i++) {
+        batch->iov[i].iov_base = &batch->msg[i];
+        batch->iov[i].iov_len = sizeof (batch->msg[i]);
+        batch->hdr[i].msg_hdr.msg_iov = &batch->iov[i];
+        batch->hdr[i].msg_hdr.msg_iovlen = 1;
+        batch->hdr[i].msg_hdr.msg_name = &batch->ss[i];
+        batch->hdr[i].msg_hdr.msg_control = batch->ctrl[i];
+    }
+
+    return (batch);
+}
+
+static int
+read_batch (int sock, fence_kdump_batch_t *batch)
+{
+    int i;
+
+    struct cmsghdr *cmsg;
+
+    for (i = 0; i < FENCE_KDUMP_BATCH_LEN; i++) {
+        batch->hdr[i].msg_hdr.msg_namelen = sizeof (batch->ss[i]);
+        batch->hdr[i].msg_hdr.msg_controllen = sizeof (batch->ctrl[i]);
+    }
+
+    batch->count = recvmmsg (sock, batch->hdr, FENCE_KDUMP_BATCH_LEN,
+                             MSG_DONTWAIT, NULL);
+    if (batch->count < 0) {
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            log_error (2, "recvmmsg (%s)\n", strerror (errno));
+        }
+        batch->count = 0;
+        return (0);
+    }
+
+    for (i = 0; i < batch->count; i++) {
+        if (set_addr (&batch->ip[i], (struct sockaddr *) &batch->ss[i]) != 0) {
+            batch->ip[i].family = AF_UNSPEC;
+        }
+
+        /* when the kernel received it, not when we got around to it */
+        batch->ts[i].tv_sec = 0;
+        batch->ts[i].tv_nsec = 0;
+        for (cmsg = CMSG_FIRSTHDR (&batch->hdr[i].msg_hdr); cmsg != NULL;
+             cmsg = CMSG_NXTHDR (&batch->hdr[i].msg_hdr, cmsg)) {
+            if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPNS)) {
+                memcpy (&batch->ts[i], CMSG_DATA (cmsg), sizeof (batch->ts[i]));
+            }
+        }
+        if (batch->ts[i].tv_sec == 0) {
+            clock_gettime (CLOCK_REALTIME, &batch->ts[i]);
+        }
+    }
+
+    return (batch->count);
+}
+
+static int
+join_group (const fence_kdump_opts_t *opts, int sock, int family)
+{
+    int error;
+    unsigned int ifindex = 0;
+    fence_kdump_addr_t group;
+    struct ip_mreqn mreq;
+    struct ipv6_mreq mreq6;
+
+    /* the group is only joined on the socket of its own family */
+    if ((opts->group == NULL) || (parse_addr (&group, opts->group, family) != 0)) {
+        return (0);
+    }
+
+    if (opts->interface != NULL) {
+        ifindex = if_nametoindex (opts->interface);
+        if (ifindex == 0) {
+            log_error (0, "unknown interface '%s'\n", opts->interface);
+            errno = ENODEV;
+            return (1);
+        }
+    }
+
+    if (family == AF_INET) {
+        memset (&mreq, 0, sizeof (mreq));
+        memcpy (&mreq.imr_multiaddr, group.data, sizeof (mreq.imr_multiaddr));
+        mreq.imr_ifindex = ifindex;
+        error = setsockopt (sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof (mreq));
+    } else {
+        memset (&mreq6, 0, sizeof (mreq6));
+        memcpy (&mreq6.ipv6mr_multiaddr, group.data, sizeof (mreq6.ipv6mr_multiaddr));
+        mreq6.ipv6mr_interface = ifindex;
+        error = setsockopt (sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq6, sizeof (mreq6));
+    }
+
+    if (error != 0) {
+        log_error (0, "failed to join group '%s' (%s)\n", opts->group, strerror (errno));
+        return (1);
+    }
+
+    log_debug (1, "joined group '%s' on socket %d\n", opts->group, sock);
+
+    return (0);
+}
+
+static int
+open_listener (const fence_kdump_opts_t *opts, int family)
 {
+    int sock;
     int error;
-    char addr[NI_MAXHOST];
-    char port[NI_MAXSERV];
+    int v6only = 1;
+    int timestamp = 1;
+    socklen_t size;
     struct sockaddr_storage ss;
-    socklen_t size = sizeof (ss);
+    struct sockaddr_in *sin = (struct sockaddr_in *) &ss;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &ss;
+
+    memset (&ss, 0, sizeof (ss));
+
+    if (family == AF_INET) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons (opts->ipport);
+        sin->sin_addr.s_addr = htonl (INADDR_ANY);
+        size = sizeof (*sin);
+    } else {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons (opts->ipport);
+        sin6->sin6_addr = in6addr_any;
+        size = sizeof (*sin6);
+    }
+
+    sock = socket (family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (sock < 0) {
+        log_error (2, "socket (%s)\n", strerror (errno));
+        return (-1);
+    }
+
+    /* allow separate ipv4 and ipv6 sockets on the same port */
+    if (family == AF_INET6) {
+        setsockopt (sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof (v6only));
+    }
+
+    setsockopt (sock, SOL_SOCKET, SO_TIMESTAMPNS, &timestamp, sizeof (timestamp));
+
+    if (bind (sock, (struct sockaddr *) &ss, size) != 0) {
+        error = errno;
+        if (error != EADDRINUSE) {
+            log_error (2, "bind (%s)\n", strerror (errno));
+        }
+        close (sock);
+        errno = error;
+        return (-1);
+    }
+
+    if (join_group (opts, sock, family) != 0) {
+        error = errno;
+        close (sock);
+        errno = error;
+        return (-1);
+    }
+
+    return (sock);
+}
+
+static int
+first_on_socket (const fence_kdump_opts_t *opts, const fence_kdump_node_t *node)
+{
+    const fence_kdump_node_t *peer;
+
+    list_for_each_entry (peer, &opts->nodes, list) {
+        if (peer->socket == node->socket) {
+            return (peer == node);
+        }
+    }
+
+    return (0);
+}
+
+static int
+filter_addr (struct sock_filter *code, int len, const fence_kdump_addr_t *ip)
+{
+    int i;
+    uint32_t word;
+
+    /* the ipv4 source address has already been loaded */
+    if (ip->family == AF_INET) {
+        memcpy (&word, ip->data, sizeof (word));
+
+        code[len++] = BPF_INSN (BPF_JMP | BPF_JEQ | BPF_K, ntohl (word), 0, 1);
+        code[len++] = BPF_INSN (BPF_RET | BPF_K, 0xFFFFFFFF, 0, 0);
+    } else {
+        for (i = 0; i < 4; i++) {
+            memcpy (&word, ip->data + (i * 4), sizeof (word));
+
+            code[len++] = BPF_INSN (BPF_LD | BPF_W | BPF_ABS,
+                                    SKF_NET_OFF + 8 + (i * 4), 0, 0);
+            code[len++] = BPF_INSN (BPF_JMP | BPF_JEQ | BPF_K,
+                                    ntohl (word), 0, 7 - (i * 2));
+        }
+        code[len++] = BPF_INSN (BPF_RET | BPF_K, 0xFFFFFFFF, 0, 0);
+    }
+
+    return (len);
+}
+
+static int
+attach_filter (const fence_kdump_opts_t *opts, int sock, int family,
+               const struct list_head *conns)
+{
+    int i;
+    int len = 0;
+    int count = 0;
+    struct sock_fprog prog;
+    struct sock_filter code[FENCE_KDUMP_FILTER_LEN];
+    const fence_kdump_node_t *node;
+    const fence_kdump_conn_t *conn;
+
+    const uint32_t versions[] = { FENCE_KDUMP_MSGV2, FENCE_KDUMP_MSGV1 };
+    /* only version 2 messages can be authenticated */
+    const int nversions = (keylen > 0) ? 1 : 2;
+
+    /*
+     * The filter runs on the udp header, the payload starts at offset 8
+     * and the ip header is reached through SKF_NET_OFF. Loads are done in
+     * network byte order while the message is sent in host byte order.
+     * The header checks are left to us when bad packets are counted.
+     */
+    if (opts->stats == FENCE_KDUMP_STATS_NONE) {
+        code[len++] = BPF_INSN (BPF_LD | BPF_W | BPF_ABS, 8, 0, 0);
+        code[len++] = BPF_INSN (BPF_JMP | BPF_JEQ | BPF_K, htonl (FENCE_KDUMP_MAGIC), 1, 0);
+        code[len++] = BPF_INSN (BPF_RET | BPF_K, 0, 0, 0);
+
+        code[len++] = BPF_INSN (BPF_LD | BPF_W | BPF_ABS, 12, 0, 0);
+        for (i = 0; i < nversions; i++) {
+            code[len++] = BPF_INSN (BPF_JMP | BPF_JEQ | BPF_K, htonl (versions[i]),
+                                    nversions - i, 0);
+        }
+        code[len++] = BPF_INSN (BPF_RET | BPF_K, 0, 0, 0);
+
+        if (keylen > 0) {
+            code[len++] = BPF_INSN (BPF_LD | BPF_W | BPF_LEN, 0, 0, 0);
+            code[len++] = BPF_INSN (BPF_JMP | BPF_JGE | BPF_K, 8 + FENCE_KDUMP_MSGV2_LEN, 1, 0);
+            code[len++] = BPF_INSN (BPF_RET | BPF_K, 0, 0, 0);
+        }
+    }
+
+    list_for_each_entry (node, &opts->nodes, list) {
+        if (node->socket == sock) {
+            count++;
+        }
+    }
+
+    /* other instances waiting through our query socket */
+    if (conns != NULL) {
+        list_for_each_entry (conn, conns, list) {
+            if ((conn->waiting) && (conn->ip.family == family)) {
+                count++;
+            }
+        }
+    }
+
+    /* the receiver accepts any sender, so does a very long node list */
+    if ((count == 0) || (len + 2 + (count * 9) > FENCE_KDUMP_FILTER_LEN)) {
+        code[len++] = BPF_INSN (BPF_RET | BPF_K, 0xFFFFFFFF, 0, 0);
+        goto attach;
+    }
+
+    if (family == AF_INET) {
+        code[len++] = BPF_INSN (BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12, 0, 0);
+    }
+
+    list_for_each_entry (node, &opts->nodes, list) {
+        if (node->socket == sock) {
+            len = filter_addr (code, len, &node->ip);
+        }
+    }
+
+    if (conns != NULL) {
+        list_for_each_entry (conn, conns, list) {
+            if ((conn->waiting) && (conn->ip.family == family)) {
+                len = filter_addr (code, len, &conn->ip);
+            }
+        }
+    }
+
+    code[len++] = BPF_INSN (BPF_RET | BPF_K, 0, 0, 0);
+
+attach:
+    prog.len = len;
+    prog.filter = code;
+
+    if (setsockopt (sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof (prog)) != 0) {
+        log_error (1, "setsockopt SO_ATTACH_FILTER (%s)\n", strerror (errno));
+        return (1);
+    }
+
+    return (0);
+}
+
+static uint32_t
+get_socket_drops (int sock)
+{
+#ifdef SO_MEMINFO
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    socklen_t size = sizeof (meminfo);
+
+    if (getsockopt (sock, SOL_SOCKET, SO_MEMINFO, meminfo, &size) == 0) {
+        return (meminfo[SK_MEMINFO_DROPS]);
+    }
+#endif
+
+    return (0);
+}
+
+static int
+check_hmac (const fence_kdump_msg_t *msg, int max_age)
+{
+    long age;
+    uint8_t digest[FENCE_KDUMP_HMAC_LEN];
+
+    if (!(ntohs (msg->flags) & FENCE_KDUMP_FLAG_HMAC)) {
+        log_debug (1, "message is not authenticated\n");
+        stats.bad_auth++;
+        return (1);
+    }
+
+    hmac_sha256 (key, keylen, msg, offsetof (fence_kdump_msg_t, hmac), digest);
+
+    if (!hmac_equal (digest, msg->hmac, sizeof (digest))) {
+        log_debug (1, "message authentication failed\n");
+        stats.bad_auth++;
+        return (1);
+    }
+
+    /* a message captured earlier, e.g. during a previous crash, is stale */
+    age = (long) time (NULL) - (long) ntohl (msg->sent);
+    if ((age > max_age) || (age < -max_age)) {
+        log_debug (1, "message was sent %ld seconds away from now\n", age);
+        stats.bad_auth++;
+        return (1);
+    }
+
+    return (0);
+}
+
+static int
+check_message (const fence_kdump_msg_t *msg, unsigned int len, int max_age)
+{
+    if (len < FENCE_KDUMP_MSGV1_LEN) {
+        log_debug (1, "invalid message length '%u'\n", len);
+        stats.bad_length++;
+        return (1);
+    }
+
+    if (msg->magic != FENCE_KDUMP_MAGIC) {
+        log_debug (1, "invalid magic number '0x%X'\n", msg->magic);
+        stats.bad_magic++;
+        return (1);
+    }
+
+    switch (msg->version) {
+    case FENCE_KDUMP_MSGV1:
+        if (keylen > 0) {
+            log_debug (1, "message is not authenticated\n");
+            stats.bad_auth++;
+            return (1);
+        }
+        return (0);
+    case FENCE_KDUMP_MSGV2:
+        if (len < FENCE_KDUMP_MSGV2_LEN) {
+            log_debug (1, "invalid message length '%u'\n", len);
+            stats.bad_length++;
+            return (1);
+        }
+        if ((keylen > 0) && (check_hmac (msg, max_age) != 0)) {
+            return (1);
+        }
+        log_debug (1, "node id %u, sequence %u, phase %s, progress %u%%\n",
+                   ntohl (msg->nodeid), ntohl (msg->seqno),
+                   message_phase (msg), msg->progress);
+        return (0);
+    default:
+        log_debug (1, "invalid message version '0x%X'\n", msg->version);
+        stats.bad_version++;
+        return (1);
+    }
+}
+
+static int
+timespec_diff_ms (const struct timespec *a, const struct timespec *b)
+{
+    return ((a->tv_sec - b->tv_sec) * 1000 +
+            (a->tv_nsec - b->tv_nsec) / 1000000);
+}
+
+static int
+set_node_state (fence_kdump_opts_t *opts, const fence_kdump_addr_t *ip, int state,
+                const struct timespec *stamp)
+{
+    int count = 0;
+    fence_kdump_node_t *node;
+
+    /* the same address may be listed more than once */
+    list_for_each_entry (node, &opts->nodes, list) {
+        if ((node->state == FENCE_KDUMP_NODE_WAITING) &&
+            (memcmp (&node->ip, ip, sizeof (*ip)) == 0)) {
+            node->state = state;
+            node->stamp = *stamp;
+            count++;
+        }
+    }
+
+    return (count);
+}
+
+static int
+report_nodes (const fence_kdump_opts_t *opts)
+{
+    int error = 0;
+    fence_kdump_node_t *node;
+
+    list_for_each_entry (node, &opts->nodes, list) {
+        if (node->state != FENCE_KDUMP_NODE_FENCED) {
+            error = 1;
+        }
+        if (!list_is_singular (&opts->nodes)) {
+            fprintf (stdout, "%s: %s\n", node->name,
+                     (node->state == FENCE_KDUMP_NODE_FENCED) ? "fenced" : "timeout");
+        }
+    }
+
+    return (error);
+}
+
+static int
+connect_query (const fence_kdump_opts_t *opts)
+{
+    int sock;
+    struct sockaddr_un sun;
+
+    memset (&sun, 0, sizeof (sun));
+
+    sun.sun_family = AF_UNIX;
+    strncpy (sun.sun_path, opts->socket, sizeof (sun.sun_path) - 1);
+
+    sock = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        log_error (2, "socket (%s)\n", strerror (errno));
+        return (-1);
+    }
+
+    if (connect (sock, (struct sockaddr *) &sun, sizeof (sun)) != 0) {
+        close (sock);
+        return (-1);
+    }
+
+    return (sock);
+}
+
+static int
+do_action_off_query (fence_kdump_opts_t *opts)
+{
+    int i;
+    int n;
+    int len;
+    int epfd;
+    int pending;
+    char buf[FENCE_KDUMP_QUERY_LEN];
+    struct epoll_event ev;
+    struct epoll_event events[FENCE_KDUMP_MAX_EVENTS];
+    fence_kdump_node_t *node;
+
+    if (list_empty (&opts->nodes)) {
+        return (1);
+    }
+
+    if (access (opts->socket, F_OK) != 0) {
+        return (-1);
+    }
+
+    epfd = epoll_create1 (EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        log_error (2, "epoll_create1 (%s)\n", strerror (errno));
+        return (-1);
+    }
+
+    pending = 0;
+    list_for_each_entry (node, &opts->nodes, list) {
+        if (node->state != FENCE_KDUMP_NODE_WAITING) {
+            continue;
+        }
+
+        node->socket = connect_query (opts);
+        if (node->socket < 0) {
+            break;
+        }
+
+        len = snprintf (buf, sizeof (buf), "off %s %d %d\n",
+                        node->addr, opts->timeout, opts->max_age);
+        if (send (node->socket, buf, len, MSG_NOSIGNAL) != len) {
+            log_error (2, "send (%s)\n", strerror (errno));
+            break;
+        }
+
+        memset (&ev, 0, sizeof (ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = node;
+
+        if (epoll_ctl (epfd, EPOLL_CTL_ADD, node->socket, &ev) != 0) {
+            log_error (2, "epoll_ctl (%s)\n", strerror (errno));
+            break;
+        }
+
+        pending++;
+
+        log_debug (0, "waiting for message from '%s' (via %s)\n",
+                   node->addr, opts->socket);
+    }
+
+    while (pending > 0) {
+        n = epoll_wait (epfd, events, FENCE_KDUMP_MAX_EVENTS,
+                        (opts->timeout + 1) * 1000);
+        if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            node = events[i].data.ptr;
+
+            len = recv (node->socket, buf, sizeof (buf) - 1, 0);
+            if (len < 0) {
+                len = 0;
+            }
+            buf[len] = 0;
+
+            if (strncmp (buf, "ok", 2) == 0) {
+                log_debug (0, "received valid message from '%s'\n", node->addr);
+                node->state = FENCE_KDUMP_NODE_FENCED;
+            } else if (len > 0) {
+                log_debug (0, "timeout after %d seconds waiting for '%s'\n",
+                           opts->timeout, node->addr);
+                node->state = FENCE_KDUMP_NODE_TIMEOUT;
+            } else {
+                /* the instance serving us went away, ask again */
+                log_debug (1, "no answer for '%s' from '%s'\n",
+                           node->addr, opts->socket);
+            }
+
+            epoll_ctl (epfd, EPOLL_CTL_DEL, node->socket, NULL);
+            pending--;
+        }
+    }
+
+    close (epfd);
+
+    pending = 0;
+    list_for_each_entry (node, &opts->nodes, list) {
+        if (node->socket >= 0) {
+            close (node->socket);
+            node->socket = -1;
+        }
+        if (node->state == FENCE_KDUMP_NODE_WAITING) {
+            pending++;
+        }
+    }
+
+    /* nobody answered for some nodes, listen for messages ourselves */
+    if (pending > 0) {
+        return (-1);
+    }
+
+    return (report_nodes (opts));
+}
+
+static int
+send_query (const fence_kdump_opts_t *opts, const char *query, char *reply, int len)
+{
+    int n;
+    int sock;
+    struct timeval tv;
+
+    sock = connect_query (opts);
+    if (sock < 0) {
+        return (1);
+    }
+
+    /* these queries are answered at once, do not hang on a stuck peer */
+    tv.tv_sec = FENCE_KDUMP_QUERY_WAIT;
+    tv.tv_usec = 0;
+    setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+    n = strlen (query);
+    if (send (sock, query, n, MSG_NOSIGNAL) != n) {
+        log_error (2, "send (%s)\n", strerror (errno));
+        close (sock);
+        return (1);
+    }
+
+    n = recv (sock, reply, len - 1, 0);
+    close (sock);
+
+    if (n <= 0) {
+        return (1);
+    }
+    reply[n] = 0;
+
+    return (0);
+}
+
+static int
+do_action_monitor (fence_kdump_opts_t *opts)
+{
+    int i;
+    int sock;
+    int error = 0;
+    char reply[FENCE_KDUMP_QUERY_LEN];
+
+    const int families[] = { AF_INET6, AF_INET };
+
+    /* a receiver or a fencing instance holds the port and answers */
+    if (send_query (opts, "monitor\n", reply, sizeof (reply)) == 0) {
+        if (strncmp (reply, "ok", 2) == 0) {
+            log_debug (1, "receiver on '%s' is running\n", opts->socket);
+            return (0);
+        }
+        log_error (0, "receiver on '%s' is not healthy\n", opts->socket);
+        return (1);
+    }
+
+    /* otherwise check that the port can be bound when fencing starts */
+    for (i = 0; i < (int) (sizeof (families) / sizeof (families[0])); i++) {
+        if ((opts->family != FENCE_KDUMP_FAMILY_AUTO) &&
+            (opts->family != families[i])) {
+            continue;
+        }
+
+        sock = open_listener (opts, families[i]);
+        if (sock >= 0) {
+            close (sock);
+            continue;
+        }
+        if ((errno == EAFNOSUPPORT) && (opts->family == FENCE_KDUMP_FAMILY_AUTO)) {
+            continue;
+        }
+
+        log_error (0, "failed to listen on port %d (%s)\n",
+                   opts->ipport, strerror (errno));
+        error = 1;
+    }
+
+    return (error);
+}
+
+static int
+do_action_status (fence_kdump_opts_t *opts)
+{
+    int age;
+    int error = 0;
+    unsigned int count;
+    unsigned int discarded;
+    unsigned int progress;
+    char phase[16];
+    char query[FENCE_KDUMP_QUERY_LEN];
+    char reply[FENCE_KDUMP_QUERY_LEN];
+    fence_kdump_node_t *node;
+
+    list_for_each_entry (node, &opts->nodes, list) {
+        snprintf (query, sizeof (query), "status %s\n", node->addr);
+
+        if (send_query (opts, query, reply, sizeof (reply)) != 0) {
+            log_error (0, "no receiver running on '%s'\n", opts->socket);
+            return (1);
+        }
+
+        if (sscanf (reply, "ok %u %u %d %15s %u",
+                    &count, &discarded, &age, phase, &progress) != 5) {
+            log_error (0, "invalid status for '%s'\n", node->addr);
+            error = 1;
+            continue;
+        }
+
+        if (count == 0) {
+            fprintf (stdout, "%s: no messages, %u discarded\n",
+                     node->name, discarded);
+            continue;
+        }
+
+        fprintf (stdout, "%s: %u messages, %u discarded, last %d ms ago, %s %u%%\n",
+                 node->name, count, discarded, age, phase, progress);
+    }
+
+    return (error);
+}
+
+static fence_kdump_peer_t *
+find_peer (struct list_head *peers, const fence_kdump_addr_t *ip)
+{
+    fence_kdump_peer_t *peer;
+
+    list_for_each_entry (peer, peers, list) {
+        if (memcmp (&peer->ip, ip, sizeof (*ip)) == 0) {
+            return (peer);
+        }
+    }
+
+    return (NULL);
+}
+
+static fence_kdump_peer_t *
+get_peer (struct list_head *peers, int *count, const fence_kdump_addr_t *ip)
+{
+    fence_kdump_peer_t *peer;
+
+    peer = find_peer (peers, ip);
+    if (peer != NULL) {
+        list_del (&peer->list);
+        return (peer);
+    }
+
+    if (*count < FENCE_KDUMP_MAX_PEERS) {
+        peer = malloc (sizeof (fence_kdump_peer_t));
+        if (!peer) {
+            log_error (2, "malloc (%s)\n", strerror (errno));
+            return (NULL);
+        }
+        *count += 1;
+    } else {
+        /* reuse the entry that was least recently heard from */
+        peer = list_entry (peers->prev, fence_kdump_peer_t, list);
+        list_del (&peer->list);
+    }
+
+    memset (peer, 0, sizeof (fence_kdump_peer_t));
+    peer->ip = *ip;
+
+    return (peer);
+}
+
+static void
+update_peer (struct list_head *peers, int *count, const fence_kdump_addr_t *ip,
+             const fence_kdump_msg_t *msg, const struct timespec *now)
+{
+    fence_kdump_peer_t *peer;
+
+    peer = get_peer (peers, count, ip);
+    if (peer == NULL) {
+        return;
+    }
+
+    peer->count++;
+
+    if (msg->version == FENCE_KDUMP_MSGV2) {
+        if ((peer->msg.version != FENCE_KDUMP_MSGV2) ||
+            (memcmp (peer->msg.bootid, msg->bootid, sizeof (msg->bootid)) != 0)) {
+            log_debug (0, "node id %u started sending messages\n", ntohl (msg->nodeid));
+        } else if (ntohl (msg->seqno) <= ntohl (peer->msg.seqno)) {
+            /* a retransmission or a replay, only the newest one counts */
+            list_add (&peer->list, peers);
+            return;
+        }
+    }
+
+    /* senders that speak both versions should not lose the details */
+    if (msg->version >= peer->msg.version) {
+        peer->msg = *msg;
+    }
+    peer->stamp = *now;
+
+    list_add (&peer->list, peers);
+}
+
+static void
+discard_peer (struct list_head *peers, int *count, const fence_kdump_addr_t *ip)
+{
+    fence_kdump_peer_t *peer;
+
+    /* counted for status, without making the sender look recent */
+    peer = find_peer (peers, ip);
+    if (peer != NULL) {
+        peer->discarded++;
+        return;
+    }
+
+    peer = get_peer (peers, count, ip);
+    if (peer == NULL) {
+        return;
+    }
+
+    peer->discarded++;
+
+    list_add_tail (&peer->list, peers);
+}
+
+static fence_kdump_conn_t *
+add_conn (int epfd, struct list_head *conns, int fd, int kind)
+{
+    struct epoll_event ev;
+    fence_kdump_conn_t *conn;
+
+    conn = malloc (sizeof (fence_kdump_conn_t));
+    if (!conn) {
+        log_error (2, "malloc (%s)\n", strerror (errno));
+        close (fd);
+        return (NULL);
+    }
+
+    memset (conn, 0, sizeof (fence_kdump_conn_t));
+    memset (&ev, 0, sizeof (ev));
+
+    conn->fd = fd;
+    conn->kind = kind;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+
+    if (epoll_ctl (epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        log_error (2, "epoll_ctl (%s)\n", strerror (errno));
+        close (fd);
+        free (conn);
+        return (NULL);
+    }
+
+    list_add_tail (&conn->list, conns);
+
+    return (conn);
+}
+
+static void
+close_conn (fence_kdump_conn_t *conn)
+{
+    /* freed once the current batch of events has been handled */
+    close (conn->fd);
+    conn->fd = -1;
+    conn->kind = FENCE_KDUMP_CONN_CLOSED;
+    conn->waiting = 0;
+}
+
+static void
+free_conn (fence_kdump_conn_t *conn)
+{
+    if (conn->fd >= 0) {
+        close (conn->fd);
+    }
+    list_del (&conn->list);
+    free (conn);
+}
+
+static void
+reply_conn (fence_kdump_conn_t *conn, const char *reply)
+{
+    send (conn->fd, reply, strlen (reply), MSG_NOSIGNAL | MSG_DONTWAIT);
+    close_conn (conn);
+}
+
+static void
+reply_status (fence_kdump_conn_t *conn, struct list_head *peers,
+              const struct timespec *now)
+{
+    int age = -1;
+    char reply[FENCE_KDUMP_QUERY_LEN];
+    fence_kdump_peer_t *peer;
+
+    if ((sscanf (conn->buf, "status %45s", conn->addr) != 1) ||
+        (parse_addr (&conn->ip, conn->addr, AF_UNSPEC) != 0)) {
+        log_debug (1, "invalid query '%s'\n", conn->buf);
+        reply_conn (conn, "error\n");
+        return;
+    }
+
+    peer = find_peer (peers, &conn->ip);
+    if (peer == NULL) {
+        reply_conn (conn, "ok 0 0 -1 unknown 0\n");
+        return;
+    }
+
+    if (peer->count > 0) {
+        age = timespec_diff_ms (now, &peer->stamp);
+    }
+
+    /* count, discarded, age in ms, phase and progress of the last message */
+    snprintf (reply, sizeof (reply), "ok %u %u %d %s %u\n",
+              peer->count, peer->discarded, age,
+              message_phase (&peer->msg), peer->msg.progress);
+
+    reply_conn (conn, reply);
+}
+
+static void
+read_query (fence_kdump_conn_t *conn, struct list_head *peers,
+            const struct timespec *now)
+{
+    int len;
+    int timeout;
+    int max_age;
+    char *eol;
+    fence_kdump_peer_t *peer;
+
+    len = recv (conn->fd, conn->buf + conn->len,
+                sizeof (conn->buf) - conn->len - 1, MSG_DONTWAIT);
+    if (len < 0) {
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            close_conn (conn);
+        }
+        return;
+    }
+    if ((len == 0) || (conn->waiting)) {
+        /* client went away or sent more than one request */
+        close_conn (conn);
+        return;
+    }
+
+    conn->len += len;
+    conn->buf[conn->len] = 0;
+
+    eol = strchr (conn->buf, '\n');
+    if (eol == NULL) {
+        if (conn->len == sizeof (conn->buf) - 1) {
+            reply_conn (conn, "error\n");
+        }
+        return;
+    }
+    *eol = 0;
+
+    if (strcmp (conn->buf, "monitor") == 0) {
+        reply_conn (conn, "ok\n");
+        return;
+    }
+
+    if (strncmp (conn->buf, "status ", 7) == 0) {
+        reply_status (conn, peers, now);
+        return;
+    }
+
+    if ((sscanf (conn->buf, "off %45s %d %d", conn->addr, &timeout, &max_age) != 3) ||
+        (parse_addr (&conn->ip, conn->addr, AF_UNSPEC) != 0)) {
+        log_debug (1, "invalid query '%s'\n", conn->buf);
+        reply_conn (conn, "error\n");
+        return;
+    }
+
+    peer = find_peer (peers, &conn->ip);
+    if ((peer != NULL) && (timespec_diff_ms (now, &peer->stamp) <= max_age * 1000)) {
+        log_debug (0, "cached message from '%s' received %d ms ago\n",
+                   conn->addr, timespec_diff_ms (now, &peer->stamp));
+        reply_conn (conn, "ok\n");
+        return;
+    }
+
+    log_debug (1, "waiting for message from '%s'\n", conn->addr);
+
+    conn->waiting = 1;
+    conn->deadline.tv_sec = now->tv_sec + timeout;
+    conn->deadline.tv_nsec = now->tv_nsec;
+}
+
+static int
+open_query (const fence_kdump_opts_t *opts)
+{
+    int sock;
+    struct sockaddr_un sun;
+
+    sock = connect_query (opts);
+    if (sock >= 0) {
+        log_error (0, "receiver already running on '%s'\n", opts->socket);
+        close (sock);
+        return (-1);
+    }
+
+    memset (&sun, 0, sizeof (sun));
+
+    sun.sun_family = AF_UNIX;
+    strncpy (sun.sun_path, opts->socket, sizeof (sun.sun_path) - 1);
+
+    sock = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (sock < 0) {
+        log_error (2, "socket (%s)\n", strerror (errno));
+        return (-1);
+    }
+
+    /* remove a stale socket left behind by a previous receiver */
+    unlink (opts->socket);
+
+    if (bind (sock, (struct sockaddr *) &sun, sizeof (sun)) != 0) {
+        if (opts->daemon) {
+            log_error (0, "bind '%s' (%s)\n", opts->socket, strerror (errno));
+        } else {
+            log_debug (1, "bind '%s' (%s)\n", opts->socket, strerror (errno));
+        }
+        close (sock);
+        return (-1);
+    }
+
+    chmod (opts->socket, S_IRUSR | S_IWUSR);
+
+    if (listen (sock, SOMAXCONN) != 0) {
+        log_error (2, "listen (%s)\n", strerror (errno));
+        close (sock);
+        unlink (opts->socket);
+        return (-1);
+    }
+
+    return (sock);
+}
+
+static void
+receive_batch (fence_kdump_opts_t *opts, const fence_kdump_batch_t *batch,
+               struct list_head *peers, int *count,
+               struct list_head *conns, const struct timespec *now)
+{
+    int i;
+    char addr[FENCE_KDUMP_ADDR_LEN];
+    fence_kdump_conn_t *client;
+
+    for (i = 0; i < batch->count; i++) {
+        if (batch->ip[i].family == AF_UNSPEC) {
+            continue;
+        }
+
+        stats.packets++;
+        if (stats.first_packet.tv_sec == 0) {
+            stats.first_packet = batch->ts[i];
+        }
+
+        if (check_message (&batch->msg[i], batch->hdr[i].msg_len, opts->max_age) != 0) {
+            log_debug (1, "discard message from '%s'\n",
+                       format_addr (&batch->ip[i], addr, sizeof (addr)));
+            discard_peer (peers, count, &batch->ip[i]);
+            stats.discarded++;
+            continue;
+        }
+
+        stats.valid++;
+        if (stats.first_valid.tv_sec == 0) {
+            stats.first_valid = batch->ts[i];
+        }
+
+        format_addr (&batch->ip[i], addr, sizeof (addr));
+        if (set_node_state (opts, &batch->ip[i], FENCE_KDUMP_NODE_FENCED,
+                            &batch->ts[i]) > 0) {
+            log_debug (0, "received valid message from '%s'\n", addr);
+        } else {
+            log_debug (1, "received valid message from '%s'\n", addr);
+        }
+        update_peer (peers, count, &batch->ip[i], &batch->msg[i], now);
+
+        list_for_each_entry (client, conns, list) {
+            if ((client->waiting) &&
+                (memcmp (&client->ip, &batch->ip[i], sizeof (batch->ip[i])) == 0)) {
+                reply_conn (client, "ok\n");
+            }
+        }
+    }
+}
+
+static int
+listening_on (const struct list_head *conns, int family)
+{
+    const fence_kdump_conn_t *conn;
+
+    list_for_each_entry (conn, conns, list) {
+        if ((conn->kind == FENCE_KDUMP_CONN_UDP) && (conn->ip.family == family)) {
+            return (1);
+        }
+    }
+
+    return (0);
+}
+
+/*
+ * Only one instance can listen on the port. While it waits for its own
+ * nodes it also serves other instances that want to fence at the same
+ * time through the query socket. The socket filter is extended with
+ * their addresses as they come in. Once its own nodes are decided it
+ * returns right away; the instances still waiting see their query
+ * closed and take over the port.
+ */
+static int
+do_action_off (fence_kdump_opts_t *opts)
+{
+    int i;
+    int n;
+    int fd;
+    int epfd;
+    int wait;
+    int pending;
+    int refilter;
+    int count = 0;
+    unsigned int drops;
+    struct timespec now;
+    struct list_head peers;
+    struct list_head conns;
+    struct epoll_event events[FENCE_KDUMP_MAX_EVENTS];
+    fence_kdump_batch_t *batch;
+    fence_kdump_node_t *node;
+    fence_kdump_conn_t *conn;
+    fence_kdump_conn_t *safe;
+    fence_kdump_conn_t *query = NULL;
+    fence_kdump_peer_t *peer;
+    fence_kdump_peer_t *next;
+
+    if (list_empty (&opts->nodes)) {
+        return (1);
+    }
+
+    INIT_LIST_HEAD (&peers);
+    INIT_LIST_HEAD (&conns);
+
+    batch = alloc_batch ();
+    if (!batch) {
+        return (1);
+    }
+
+    epfd = epoll_create1 (EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        log_error (2, "epoll_create1 (%s)\n", strerror (errno));
+        free (batch);
+        return (1);
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+
+    pending = 0;
+    list_for_each_entry (node, &opts->nodes, list) {
+        /* nodes of the same family share one socket */
+        if (first_on_socket (opts, node)) {
+            conn = add_conn (epfd, &conns, node->socket, FENCE_KDUMP_CONN_UDP);
+            if (conn == NULL) {
+                node->socket = -1;
+                break;
+            }
+            conn->ip.family = node->ip.family;
+        }
+
+        if (node->state != FENCE_KDUMP_NODE_WAITING) {
+            continue;
+        }
+
+        node->deadline.tv_sec = now.tv_sec + opts->timeout;
+        node->deadline.tv_nsec = now.tv_nsec;
+        pending++;
+
+        log_debug (0, "waiting for message from '%s'\n", node->addr);
+    }
+
+    fd = open_query (opts);
+    if (fd >= 0) {
+        query = add_conn (epfd, &conns, fd, FENCE_KDUMP_CONN_QUERY);
+    }
+    if (query == NULL) {
+        log_debug (1, "not serving other instances on '%s'\n", opts->socket);
+    }
+
+    while (pending > 0) {
+        wait = -1;
+        list_for_each_entry (node, &opts->nodes, list) {
+            if (node->state != FENCE_KDUMP_NODE_WAITING) {
+                continue;
+            }
+            n = timespec_diff_ms (&node->deadline, &now);
+            if ((wait < 0) || (n < wait)) {
+                wait = (n > 0) ? n : 0;
+            }
+        }
+        list_for_each_entry (conn, &conns, list) {
+            if (!conn->waiting) {
+                continue;
+            }
+            n = timespec_diff_ms (&conn->deadline, &now);
+            if ((wait < 0) || (n < wait)) {
+                wait = (n > 0) ? n : 0;
+            }
+        }
+
+        n = epoll_wait (epfd, events, FENCE_KDUMP_MAX_EVENTS, wait);
+        if ((n < 0) && (errno != EINTR)) {
+            log_error (2, "epoll_wait (%s)\n", strerror (errno));
+            break;
+        }
+
+        clock_gettime (CLOCK_MONOTONIC, &now);
+
+        refilter = 0;
+        for (i = 0; i < n; i++) {
+            conn = events[i].data.ptr;
+
+            switch (conn->kind) {
+            case FENCE_KDUMP_CONN_UDP:
+                while (read_batch (conn->fd, batch) > 0) {
+                    receive_batch (opts, batch, &peers, &count, &conns, &now);
+
+                    /* a short batch means the socket has been drained */
+                    if (batch->count < FENCE_KDUMP_BATCH_LEN) {
+                        break;
+                    }
+                }
+                break;
+            case FENCE_KDUMP_CONN_QUERY:
+                fd = accept4 (conn->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+                if (fd >= 0) {
+                    add_conn (epfd, &conns, fd, FENCE_KDUMP_CONN_CLIENT);
+                }
+                break;
+            case FENCE_KDUMP_CONN_CLIENT:
+                read_query (conn, &peers, &now);
+                if (!conn->waiting) {
+                    break;
+                }
+                if (!listening_on (&conns, conn->ip.family)) {
+                    reply_conn (conn, "error\n");
+                    break;
+                }
+                refilter = 1;
+                break;
+            default:
+                break;
+            }
+        }
+
+        if (refilter) {
+            list_for_each_entry (conn, &conns, list) {
+                if (conn->kind == FENCE_KDUMP_CONN_UDP) {
+                    attach_filter (opts, conn->fd, conn->ip.family, &conns);
+                }
+            }
+        }
+
+        pending = 0;
+        list_for_each_entry (node, &opts->nodes, list) {
+            if (node->state != FENCE_KDUMP_NODE_WAITING) {
+                continue;
+            }
+            if (timespec_diff_ms (&node->deadline, &now) <= 0) {
+                log_debug (0, "timeout after %d seconds waiting for '%s'\n",
+                           opts->timeout, node->addr);
+                node->state = FENCE_KDUMP_NODE_TIMEOUT;
+                continue;
+            }
+            pending++;
+        }
 
-    error = recvfrom (node->socket, msg, len, 0, (struct sockaddr *) &ss, &size);
-    if (error < 0) {
-        log_error (2, "recvfrom (%s)\n", strerror (errno));
-        goto out;
+        list_for_each_entry_safe (conn, safe, &conns, list) {
+            if ((conn->waiting) && (timespec_diff_ms (&conn->deadline, &now) <= 0)) {
+                log_debug (0, "timeout waiting for '%s'\n", conn->addr);
+                reply_conn (conn, "timeout\n");
+            }
+            if (conn->kind == FENCE_KDUMP_CONN_CLOSED) {
+                free_conn (conn);
+            }
+        }
     }
 
-    error = getnameinfo ((struct sockaddr *) &ss, size,
-                         addr, sizeof (addr),
-                         port, sizeof (port),
-                         NI_NUMERICHOST | NI_NUMERICSERV);
-    if (error != 0) {
-        log_error (2, "getnameinfo (%s)\n", gai_strerror (error));
-        goto out;
+    /* instances connecting from now on see the socket close and retry */
+    if (query != NULL) {
+        unlink (opts->socket);
     }
 
-    error = strcasecmp (node->addr, addr);
-    if (error != 0) {
-        log_debug (1, "discard message from '%s'\n", addr);
+    /*
+     * The ports are released before the instances still waiting are
+     * dropped, so that they can bind them as soon as they notice.
+     */
+    list_for_each_entry_safe (conn, safe, &conns, list) {
+        if (conn->kind == FENCE_KDUMP_CONN_UDP) {
+            drops = get_socket_drops (conn->fd);
+            log_debug (1, "%u packets dropped by the kernel on socket %d\n",
+                       drops, conn->fd);
+            stats.kernel_drops += drops;
+        } else if (conn->waiting) {
+            log_debug (1, "leaving '%s' to another instance\n", conn->addr);
+        }
+        free_conn (conn);
+    }
+    list_for_each_entry (node, &opts->nodes, list) {
+        node->socket = -1;
+    }
+    list_for_each_entry_safe (peer, next, &peers, list) {
+        list_del (&peer->list);
+        free (peer);
     }
 
-out:
-    return (error);
+    close (epfd);
+    free (batch);
+
+    return (report_nodes (opts));
+}
+
+static void
+handle_signal (int sig)
+{
+    terminate = sig;
 }
 
 static int
-do_action_off (const fence_kdump_opts_t *opts)
+do_daemon (fence_kdump_opts_t *opts)
 {
-    int error;
-    fd_set rfds;
-    fence_kdump_msg_t msg;
-    fence_kdump_node_t *node;
-    struct timeval timeout;
+    int i;
+    int n;
+    int fd;
+    int epfd;
+    int wait;
+    int count = 0;
+    struct sigaction sa;
+    struct timespec now;
+    struct list_head peers;
+    struct list_head conns;
+    struct epoll_event events[FENCE_KDUMP_MAX_EVENTS];
+    fence_kdump_batch_t *batch;
+    fence_kdump_conn_t *conn;
+    fence_kdump_conn_t *safe;
+    fence_kdump_peer_t *peer;
+    fence_kdump_peer_t *next;
+
+    const int families[] = { AF_INET6, AF_INET };
+
+    INIT_LIST_HEAD (&peers);
+    INIT_LIST_HEAD (&conns);
+
+    batch = alloc_batch ();
+    if (!batch) {
+        return (1);
+    }
 
-    if (list_empty (&opts->nodes)) {
+    epfd = epoll_create1 (EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        log_error (2, "epoll_create1 (%s)\n", strerror (errno));
+        free (batch);
         return (1);
-    } else {
-        node = list_first_entry (&opts->nodes, fence_kdump_node_t, list);
     }
 
-    timeout.tv_sec = opts->timeout;
-    timeout.tv_usec = 0;
+    for (i = 0; i < (int) (sizeof (families) / sizeof (families[0])); i++) {
+        if ((opts->family != FENCE_KDUMP_FAMILY_AUTO) &&
+            (opts->family != families[i])) {
+            continue;
+        }
+
+        fd = open_listener (opts, families[i]);
+        if (fd >= 0) {
+            attach_filter (opts, fd, families[i], NULL);
+            add_conn (epfd, &conns, fd, FENCE_KDUMP_CONN_UDP);
+        }
+    }
 
-    FD_ZERO (&rfds);
-    FD_SET (node->socket, &rfds);
+    if (list_empty (&conns)) {
+        log_error (0, "failed to listen on port %d\n", opts->ipport);
+        close (epfd);
+        free (batch);
+        return (1);
+    }
 
-    log_debug (0, "waiting for message from '%s'\n", node->addr);
+    fd = open_query (opts);
+    if ((fd < 0) || (add_conn (epfd, &conns, fd, FENCE_KDUMP_CONN_QUERY) == NULL)) {
+        list_for_each_entry_safe (conn, safe, &conns, list) {
+            free_conn (conn);
+        }
+        close (epfd);
+        free (batch);
+        return (1);
+    }
 
-    for (;;) {
-        error = select (node->socket + 1, &rfds, NULL, NULL, &timeout);
-        if (error < 0) {
-            log_error (2, "select (%s)\n", strerror (errno));
-            break;
+    memset (&sa, 0, sizeof (sa));
+    sa.sa_handler = handle_signal;
+    sigaction (SIGINT, &sa, NULL);
+    sigaction (SIGTERM, &sa, NULL);
+    signal (SIGPIPE, SIG_IGN);
+
+    log_debug (0, "receiving messages on port %d, queries on '%s'\n",
+               opts->ipport, opts->socket);
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+
+    while (!terminate) {
+        wait = -1;
+        list_for_each_entry (conn, &conns, list) {
+            if (!conn->waiting) {
+                continue;
+            }
+            n = timespec_diff_ms (&conn->deadline, &now);
+            if ((wait < 0) || (n < wait)) {
+                wait = (n > 0) ? n : 0;
+            }
         }
-        if (error == 0) {
-            log_debug (0, "timeout after %d seconds\n", opts->timeout);
+
+        n = epoll_wait (epfd, events, FENCE_KDUMP_MAX_EVENTS, wait);
+        if ((n < 0) && (errno != EINTR)) {
+            log_error (2, "epoll_wait (%s)\n", strerror (errno));
             break;
         }
 
-        if (read_message (node, &msg, sizeof (msg)) != 0) {
-            continue;
+        clock_gettime (CLOCK_MONOTONIC, &now);
+
+        for (i = 0; i < n; i++) {
+            conn = events[i].data.ptr;
+
+            switch (conn->kind) {
+            case FENCE_KDUMP_CONN_UDP:
+                while (read_batch (conn->fd, batch) > 0) {
+                    receive_batch (opts, batch, &peers, &count, &conns, &now);
+
+                    if (batch->count < FENCE_KDUMP_BATCH_LEN) {
+                        break;
+                    }
+                }
+                break;
+            case FENCE_KDUMP_CONN_QUERY:
+                fd = accept4 (conn->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+                if (fd >= 0) {
+                    add_conn (epfd, &conns, fd, FENCE_KDUMP_CONN_CLIENT);
+                }
+                break;
+            case FENCE_KDUMP_CONN_CLIENT:
+                read_query (conn, &peers, &now);
+                break;
+            default:
+                break;
+            }
         }
 
-        if (msg.magic != FENCE_KDUMP_MAGIC) {
-            log_debug (1, "invalid magic number '0x%X'\n", msg.magic);
-            continue;
+        list_for_each_entry_safe (conn, safe, &conns, list) {
+            if ((conn->waiting) && (timespec_diff_ms (&conn->deadline, &now) <= 0)) {
+                log_debug (0, "timeout waiting for '%s'\n", conn->addr);
+                reply_conn (conn, "timeout\n");
+            }
+            if (conn->kind == FENCE_KDUMP_CONN_CLOSED) {
+                free_conn (conn);
+            }
         }
+    }
 
-        switch (msg.version) {
-        case FENCE_KDUMP_MSGV1:
-            log_debug (0, "received valid message from '%s'\n", node->addr);
-            return (0);
-        default:
-            log_debug (1, "invalid message version '0x%X'\n", msg.version);
-            continue;
+    log_debug (0, "receiver exiting\n");
+
+    list_for_each_entry_safe (conn, safe, &conns, list) {
+        if (conn->kind == FENCE_KDUMP_CONN_UDP) {
+            log_debug (1, "%u packets dropped by the kernel on socket %d\n",
+                       get_socket_drops (conn->fd), conn->fd);
         }
+        free_conn (conn);
+    }
+    list_for_each_entry_safe (peer, next, &peers, list) {
+        list_del (&peer->list);
+        free (peer);
     }
 
-    return (1);
+    unlink (opts->socket);
+    close (epfd);
+    free (batch);
+
+    return (0);
 }
 
 static int
@@ -217,6 +1748,57 @@ do_action_metadata (const char *self)
              "Timeout in seconds");
     fprintf (stdout, "\t</parameter>\n");
 
+    fprintf (stdout, "\t<parameter name=\"socket\" unique=\"0\" required=\"0\">\n");
+    fprintf (stdout, "\t\t<getopt mixed=\"-S, --socket\" />\n");
+    fprintf (stdout, "\t\t<content type=\"string\" default=\"%s\" />\n",
+             FENCE_KDUMP_DEFAULT_SOCKET);
+    fprintf (stdout, "\t\t<shortdesc lang=\"en\">%s</shortdesc>\n",
+             "Receiver query socket");
+    fprintf (stdout, "\t</parameter>\n");
+
+    fprintf (stdout, "\t<parameter name=\"max_age\" unique=\"0\" required=\"0\">\n");
+    fprintf (stdout, "\t\t<getopt mixed=\"-A, --max-age\" />\n");
+    fprintf (stdout, "\t\t<content type=\"string\" default=\"%d\" />\n",
+             FENCE_KDUMP_DEFAULT_MAX_AGE);
+    fprintf (stdout, "\t\t<shortdesc lang=\"en\">%s</shortdesc>\n",
+             "Accept messages cached by the receiver up to this age in seconds");
+    fprintf (stdout, "\t</parameter>\n");
+
+    fprintf (stdout, "\t<parameter name=\"hosts\" unique=\"0\" required=\"0\">\n");
+    fprintf (stdout, "\t\t<getopt mixed=\"-H, --hosts\" />\n");
+    fprintf (stdout, "\t\t<content type=\"string\" />\n");
+    fprintf (stdout, "\t\t<shortdesc lang=\"en\">%s</shortdesc>\n",
+             "Resolve node names only from this file");
+    fprintf (stdout, "\t</parameter>\n");
+
+    fprintf (stdout, "\t<parameter name=\"key_file\" unique=\"0\" required=\"0\">\n");
+    fprintf (stdout, "\t\t<getopt mixed=\"-k, --key-file\" />\n");
+    fprintf (stdout, "\t\t<content type=\"string\" />\n");
+    fprintf (stdout, "\t\t<shortdesc lang=\"en\">%s</shortdesc>\n",
+             "Accept only messages authenticated with the key in this file");
+    fprintf (stdout, "\t</parameter>\n");
+
+    fprintf (stdout, "\t<parameter name=\"stats\" unique=\"0\" required=\"0\">\n");
+    fprintf (stdout, "\t\t<getopt mixed=\"-s, --stats\" />\n");
+    fprintf (stdout, "\t\t<content type=\"string\" default=\"none\" />\n");
+    fprintf (stdout, "\t\t<shortdesc lang=\"en\">%s</shortdesc>\n",
+             "Print timing and packet counts (none, json)");
+    fprintf (stdout, "\t</parameter>\n");
+
+    fprintf (stdout, "\t<parameter name=\"group\" unique=\"0\" required=\"0\">\n");
+    fprintf (stdout, "\t\t<getopt mixed=\"-g, --group\" />\n");
+    fprintf (stdout, "\t\t<content type=\"string\" />\n");
+    fprintf (stdout, "\t\t<shortdesc lang=\"en\">%s</shortdesc>\n",
+             "Also receive messages sent to this multicast group");
+    fprintf (stdout, "\t</parameter>\n");
+
+    fprintf (stdout, "\t<parameter name=\"interface\" unique=\"0\" required=\"0\">\n");
+    fprintf (stdout, "\t\t<getopt mixed=\"-m, --interface\" />\n");
+    fprintf (stdout, "\t\t<content type=\"string\" />\n");
+    fprintf (stdout, "\t\t<shortdesc lang=\"en\">%s</shortdesc>\n",
+             "Join the multicast group on this interface");
+    fprintf (stdout, "\t</parameter>\n");
+
     fprintf (stdout, "\t<parameter name=\"verbose\" unique=\"0\" required=\"0\">\n");
     fprintf (stdout, "\t\t<getopt mixed=\"-v, --verbose\" />\n");
     fprintf (stdout, "\t\t<content type=\"boolean\" />\n");
@@ -242,6 +1824,8 @@ do_action_metadata (const char *self)
 
     fprintf (stdout, "<actions>\n");
     fprintf (stdout, "\t<action name=\"off\" />\n");
+    fprintf (stdout, "\t<action name=\"status\" />\n");
+    fprintf (stdout, "\t<action name=\"monitor\" />\n");
     fprintf (stdout, "\t<action name=\"metadata\" />\n");
     fprintf (stdout, "</actions>\n");
 
@@ -258,15 +1842,31 @@ print_usage (const char *self)
     fprintf (stdout, "Options:\n");
     fprintf (stdout, "\n");
     fprintf (stdout, "%s\n",
-             "  -n, --nodename=NODE          Name or IP address of node to be fenced");
+             "  -n, --nodename=NODE[,NODE]   Name or IP address of node(s) to be fenced");
     fprintf (stdout, "%s\n",
              "  -p, --ipport=PORT            IP port number (default: 7410)");
     fprintf (stdout, "%s\n",
              "  -f, --family=FAMILY          Network family: ([auto], ipv4, ipv6)");
     fprintf (stdout, "%s\n",
-             "  -o, --action=ACTION          Fencing action: ([off], metadata)");
+             "  -o, --action=ACTION          Fencing action: ([off], status, monitor, metadata)");
     fprintf (stdout, "%s\n",
              "  -t, --timeout=TIMEOUT        Timeout in seconds (default: 60)");
+    fprintf (stdout, "%s\n",
+             "  -D, --daemon                 Run as receiver and answer queries");
+    fprintf (stdout, "%s\n",
+             "  -S, --socket=PATH            Receiver query socket");
+    fprintf (stdout, "%s\n",
+             "  -A, --max-age=SECONDS        Accept cached messages up to this age (default: 20)");
+    fprintf (stdout, "%s\n",
+             "  -H, --hosts=FILE             Resolve node names only from FILE");
+    fprintf (stdout, "%s\n",
+             "  -k, --key-file=FILE          Accept only messages authenticated with FILE");
+    fprintf (stdout, "%s\n",
+             "  -s, --stats=FORMAT           Print timing and packet counts: ([none], json)");
+    fprintf (stdout, "%s\n",
+             "  -g, --group=ADDR             Also receive messages sent to multicast group ADDR");
+    fprintf (stdout, "%s\n",
+             "  -m, --interface=IFACE        Join the multicast group on IFACE");
     fprintf (stdout, "%s\n",
              "  -v, --verbose                Print verbose output");
     fprintf (stdout, "%s\n",
@@ -279,81 +1879,215 @@ print_usage (const char *self)
 }
 
 static int
-get_options_node (fence_kdump_opts_t *opts)
+lookup_hosts (const fence_kdump_opts_t *opts, const char *name, fence_kdump_addr_t *ip)
+{
+    int found = 0;
+    char buf[1024];
+    char *addr;
+    char *alias;
+    char *save;
+    FILE *file;
+
+    file = fopen (opts->hosts, "r");
+    if (!file) {
+        log_error (0, "failed to open '%s' (%s)\n", opts->hosts, strerror (errno));
+        return (1);
+    }
+
+    /* same format as /etc/hosts: address followed by names */
+    while ((!found) && (fgets (buf, sizeof (buf), file) != NULL)) {
+        if ((alias = strchr (buf, '#')) != NULL) {
+            *alias = 0;
+        }
+
+        addr = strtok_r (buf, " \t\n", &save);
+        if (addr == NULL) {
+            continue;
+        }
+
+        while ((alias = strtok_r (NULL, " \t\n", &save)) != NULL) {
+            if ((strcasecmp (alias, name) == 0) &&
+                (parse_addr (ip, addr, opts->family) == 0)) {
+                found = 1;
+                break;
+            }
+        }
+    }
+
+    fclose (file);
+
+    return (!found);
+}
+
+static int
+resolve_node (const fence_kdump_opts_t *opts, const char *name, fence_kdump_addr_t *ip)
 {
     int error;
     struct addrinfo hints;
-    fence_kdump_node_t *node;
+    struct addrinfo *info;
 
-    node = malloc (sizeof (fence_kdump_node_t));
-    if (!node) {
-        log_error (2, "malloc (%s)\n", strerror (errno));
-        return (1);
+    /* numeric addresses and the hosts file never touch the resolver */
+    if (parse_addr (ip, name, opts->family) == 0) {
+        return (0);
+    }
+
+    if (opts->hosts != NULL) {
+        return (lookup_hosts (opts, name, ip));
     }
 
-    memset (node, 0, sizeof (fence_kdump_node_t));
     memset (&hints, 0, sizeof (hints));
 
     hints.ai_family = opts->family;
     hints.ai_socktype = SOCK_DGRAM;
     hints.ai_protocol = IPPROTO_UDP;
-    hints.ai_flags = AI_NUMERICSERV;
-
-    strncpy (node->name, opts->nodename, sizeof (node->name));
-    snprintf (node->port, sizeof (node->port), "%d", opts->ipport);
 
-    node->info = NULL;
-    error = getaddrinfo (node->name, node->port, &hints, &node->info);
+    error = getaddrinfo (name, NULL, &hints, &info);
     if (error != 0) {
         log_error (2, "getaddrinfo (%s)\n", gai_strerror (error));
-        free_node (node);
         return (1);
     }
 
-    error = getnameinfo (node->info->ai_addr, node->info->ai_addrlen,
-                         node->addr, sizeof (node->addr),
-                         node->port, sizeof (node->port),
-                         NI_NUMERICHOST | NI_NUMERICSERV);
-    if (error != 0) {
-        log_error (2, "getnameinfo (%s)\n", gai_strerror (error));
-        free_node (node);
+    error = set_addr (ip, info->ai_addr);
+
+    freeaddrinfo (info);
+
+    return (error);
+}
+
+static int
+get_options_node (fence_kdump_opts_t *opts, const char *name)
+{
+    fence_kdump_node_t *node;
+
+    node = malloc (sizeof (fence_kdump_node_t));
+    if (!node) {
+        log_error (2, "malloc (%s)\n", strerror (errno));
         return (1);
     }
 
-    hints.ai_family = node->info->ai_family;
-    hints.ai_flags |= AI_PASSIVE;
+    memset (node, 0, sizeof (fence_kdump_node_t));
+
+    init_node (node);
 
-    freeaddrinfo (node->info);
+    strncpy (node->name, name, sizeof (node->name) - 1);
+    snprintf (node->port, sizeof (node->port), "%d", opts->ipport);
 
-    node->info = NULL;
-    error = getaddrinfo (NULL, node->port, &hints, &node->info);
-    if (error != 0) {
-        log_error (2, "getaddrinfo (%s)\n", gai_strerror (error));
+    if (resolve_node (opts, node->name, &node->ip) != 0) {
         free_node (node);
         return (1);
     }
 
-    node->socket = socket (node->info->ai_family,
-                           node->info->ai_socktype,
-                           node->info->ai_protocol);
-    if (node->socket < 0) {
-        log_error (2, "socket (%s)\n", strerror (errno));
-        free_node (node);
-        return (1);
+    format_addr (&node->ip, node->addr, sizeof (node->addr));
+
+    list_add_tail (&node->list, &opts->nodes);
+
+    return (0);
+}
+
+static int
+get_options_sockets (fence_kdump_opts_t *opts)
+{
+    int busy;
+    fence_kdump_node_t *node;
+    fence_kdump_node_t *peer;
+    fence_kdump_node_t *failed = NULL;
+
+    list_for_each_entry (node, &opts->nodes, list) {
+        /* all nodes of the same family are received on one socket */
+        list_for_each_entry (peer, &opts->nodes, list) {
+            if (peer == node) {
+                break;
+            }
+            if (peer->ip.family == node->ip.family) {
+                node->socket = peer->socket;
+                break;
+            }
+        }
+
+        if (node->socket >= 0) {
+            continue;
+        }
+
+        node->socket = open_listener (opts, node->ip.family);
+        if (node->socket < 0) {
+            failed = node;
+            break;
+        }
     }
 
-    error = bind (node->socket, node->info->ai_addr, node->info->ai_addrlen);
-    if (error != 0) {
-        log_error (2, "bind (%s)\n", strerror (errno));
-        free_node (node);
-        return (1);
+    if (failed != NULL) {
+        /* another instance is listening on the port */
+        busy = (errno == EADDRINUSE);
+        if (!busy) {
+            log_error (0, "failed to listen for node '%s'\n", failed->name);
+        }
+
+        list_for_each_entry (peer, &opts->nodes, list) {
+            if ((peer->socket >= 0) && first_on_socket (opts, peer)) {
+                close (peer->socket);
+            }
+        }
+        list_for_each_entry (peer, &opts->nodes, list) {
+            peer->socket = -1;
+        }
+
+        return (busy ? -1 : 1);
     }
 
-    list_add_tail (&node->list, &opts->nodes);
+    list_for_each_entry (node, &opts->nodes, list) {
+        if (first_on_socket (opts, node)) {
+            attach_filter (opts, node->socket, node->ip.family, NULL);
+        }
+    }
+
+    return (0);
+}
+
+static int
+has_family (const fence_kdump_opts_t *opts, int family)
+{
+    const fence_kdump_node_t *node;
+
+    list_for_each_entry (node, &opts->nodes, list) {
+        if (node->ip.family == family) {
+            return (1);
+        }
+    }
 
     return (0);
 }
 
+static int
+get_options_nodes (fence_kdump_opts_t *opts)
+{
+    int error = 0;
+    char *names;
+    char *name;
+    char *save;
+
+    names = strdup (opts->nodename);
+    if (!names) {
+        log_error (2, "strdup (%s)\n", strerror (errno));
+        return (1);
+    }
+
+    for (name = strtok_r (names, FENCE_KDUMP_NODE_DELIM, &save); name != NULL;
+         name = strtok_r (NULL, FENCE_KDUMP_NODE_DELIM, &save)) {
+        if (get_options_node (opts, name) != 0) {
+            log_error (0, "failed to get node '%s'\n", name);
+            error = 1;
+        }
+    }
+
+    free (names);
+
+    if (list_empty (&opts->nodes)) {
+        error = 1;
+    }
+
+    return (error);
+}
+
 static void
 get_options (int argc, char **argv, fence_kdump_opts_t *opts)
 {
@@ -365,13 +2099,21 @@ get_options (int argc, char **argv, fence_kdump_opts_t *opts)
         { "family",   required_argument, NULL, 'f' },
         { "action",   required_argument, NULL, 'o' },
         { "timeout",  required_argument, NULL, 't' },
+        { "daemon",   no_argument,       NULL, 'D' },
+        { "socket",   required_argument, NULL, 'S' },
+        { "max-age",  required_argument, NULL, 'A' },
+        { "hosts",    required_argument, NULL, 'H' },
+        { "key-file", required_argument, NULL, 'k' },
+        { "stats",    required_argument, NULL, 's' },
+        { "group",    required_argument, NULL, 'g' },
+        { "interface", required_argument, NULL, 'm' },
         { "verbose",  optional_argument, NULL, 'v' },
         { "version",  no_argument,       NULL, 'V' },
         { "help",     no_argument,       NULL, 'h' },
         { 0, 0, 0, 0 }
     };
 
-    while ((opt = getopt_long (argc, argv, "n:p:f:o:t:v::Vh", options, NULL)) != EOF) {
+    while ((opt = getopt_long (argc, argv, "n:p:f:o:t:DS:A:H:k:s:g:m:v::Vh", options, NULL)) != EOF) {
         switch (opt) {
         case 'n':
             set_option_nodename (opts, optarg);
@@ -388,6 +2130,30 @@ get_options (int argc, char **argv, fence_kdump_opts_t *opts)
         case 't':
             set_option_timeout (opts, optarg);
             break;
+        case 'D':
+            opts->daemon = 1;
+            break;
+        case 'S':
+            set_option_socket (opts, optarg);
+            break;
+        case 'A':
+            set_option_max_age (opts, optarg);
+            break;
+        case 'H':
+            set_option_hosts (opts, optarg);
+            break;
+        case 'k':
+            set_option_keyfile (opts, optarg);
+            break;
+        case 's':
+            set_option_stats (opts, optarg);
+            break;
+        case 'g':
+            set_option_group (opts, optarg);
+            break;
+        case 'm':
+            set_option_interface (opts, optarg);
+            break;
         case 'v':
             set_option_verbose (opts, optarg);
             break;
@@ -452,6 +2218,34 @@ get_options_stdin (fence_kdump_opts_t *opts)
             set_option_timeout (opts, arg);
             continue;
         }
+        if (!strcasecmp (opt, "socket")) {
+            set_option_socket (opts, arg);
+            continue;
+        }
+        if (!strcasecmp (opt, "max_age")) {
+            set_option_max_age (opts, arg);
+            continue;
+        }
+        if (!strcasecmp (opt, "hosts")) {
+            set_option_hosts (opts, arg);
+            continue;
+        }
+        if (!strcasecmp (opt, "key_file")) {
+            set_option_keyfile (opts, arg);
+            continue;
+        }
+        if (!strcasecmp (opt, "stats")) {
+            set_option_stats (opts, arg);
+            continue;
+        }
+        if (!strcasecmp (opt, "group")) {
+            set_option_group (opts, arg);
+            continue;
+        }
+        if (!strcasecmp (opt, "interface")) {
+            set_option_interface (opts, arg);
+            continue;
+        }
         if (!strcasecmp (opt, "verbose")) {
             set_option_verbose (opts, arg);
             continue;
@@ -463,10 +2257,134 @@ get_options_stdin (fence_kdump_opts_t *opts)
     return;
 }
 
+static void
+print_stats_ms (const char *name, const struct timespec *from, const struct timespec *to)
+{
+    if ((from->tv_sec == 0) || (to->tv_sec == 0)) {
+        fprintf (stdout, "\"%s\": null, ", name);
+        return;
+    }
+
+    fprintf (stdout, "\"%s\": %.3f, ", name,
+             (to->tv_sec - from->tv_sec) * 1000.0 +
+             (to->tv_nsec - from->tv_nsec) / 1000000.0);
+}
+
+static void
+print_stats_string (const char *name, const char *value)
+{
+    const unsigned char *c;
+
+    fprintf (stdout, "\"%s\": \"", name);
+    for (c = (const unsigned char *) value; *c != '\0'; c++) {
+        if ((*c == '"') || (*c == '\\')) {
+            fprintf (stdout, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf (stdout, "\\u%04x", *c);
+        } else {
+            fputc (*c, stdout);
+        }
+    }
+    fprintf (stdout, "\", ");
+}
+
+static void
+report_stats (const fence_kdump_opts_t *opts)
+{
+    int first = 1;
+    const struct timespec never = { 0, 0 };
+    const fence_kdump_node_t *node;
+
+    /* one line, times in milliseconds, null for what did not happen */
+    fprintf (stdout, "{ ");
+    print_stats_ms ("resolve_ms", &stats.start, &stats.resolved);
+    print_stats_ms ("bind_ms", &stats.binding, &stats.bound);
+    print_stats_ms ("first_packet_ms", &stats.bound, &stats.first_packet);
+    print_stats_ms ("first_valid_ms", &stats.first_packet, &stats.first_valid);
+    fprintf (stdout, "\"packets\": %u, \"valid\": %u, \"discarded\": %u, ",
+             stats.packets, stats.valid, stats.discarded);
+    fprintf (stdout, "\"bad_magic\": %u, \"bad_version\": %u, ",
+             stats.bad_magic, stats.bad_version);
+    fprintf (stdout, "\"bad_length\": %u, \"bad_auth\": %u, \"kernel_drops\": %u, ",
+             stats.bad_length, stats.bad_auth, stats.kernel_drops);
+
+    fprintf (stdout, "\"nodes\": [");
+    list_for_each_entry (node, &opts->nodes, list) {
+        fprintf (stdout, "%s{ ", first ? " " : ", ");
+        print_stats_string ("name", node->name);
+        print_stats_string ("addr", node->addr);
+        print_stats_ms ("fenced_ms", &stats.bound,
+                        (node->state == FENCE_KDUMP_NODE_FENCED) ? &node->stamp : &never);
+        fprintf (stdout, "\"state\": \"%s\" }",
+                 (node->state == FENCE_KDUMP_NODE_FENCED) ? "fenced" : "timeout");
+        first = 0;
+    }
+    fprintf (stdout, " ] }\n");
+}
+
+static int
+do_action_off_shared (fence_kdump_opts_t *opts)
+{
+    int error;
+    int timeout = opts->timeout;
+    struct timespec start;
+    struct timespec now;
+    fence_kdump_node_t *node;
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    now = start;
+
+    /*
+     * Ask the receiver or another instance that is listening on the port
+     * first. If neither answers, listen ourselves, and if the port was
+     * taken in the meantime, go back to asking whoever took it.
+     */
+    for (;;) {
+        opts->timeout = timeout - (timespec_diff_ms (&now, &start) / 1000);
+
+        error = do_action_off_query (opts);
+        if (error >= 0) {
+            return (error);
+        }
+
+        clock_gettime (CLOCK_REALTIME, &stats.binding);
+        error = get_options_sockets (opts);
+        if (error == 0) {
+            clock_gettime (CLOCK_REALTIME, &stats.bound);
+            return (do_action_off (opts));
+        }
+        if (error > 0) {
+            return (1);
+        }
+
+        clock_gettime (CLOCK_MONOTONIC, &now);
+        if (timespec_diff_ms (&now, &start) >= timeout * 1000) {
+            break;
+        }
+
+        log_debug (1, "port %d is busy, retrying through '%s'\n",
+                   opts->ipport, opts->socket);
+        usleep (FENCE_KDUMP_RETRY_WAIT * 1000);
+    }
+
+    opts->timeout = timeout;
+
+    list_for_each_entry (node, &opts->nodes, list) {
+        if (node->state == FENCE_KDUMP_NODE_WAITING) {
+            log_debug (0, "timeout after %d seconds waiting for '%s'\n",
+                       opts->timeout, node->addr);
+            node->state = FENCE_KDUMP_NODE_TIMEOUT;
+        }
+    }
+
+    return (report_nodes (opts));
+}
+
 int
 main (int argc, char **argv)
 {
     int error = 1;
+    fence_kdump_addr_t group;
     fence_kdump_opts_t opts;
 
     init_options (&opts);
@@ -479,13 +2397,42 @@ main (int argc, char **argv)
 
     openlog ("fence_kdump", LOG_CONS|LOG_PID, LOG_DAEMON);
 
-    if (opts.action == FENCE_KDUMP_ACTION_OFF) {
+    if ((opts.keyfile != NULL) && (read_key_file (opts.keyfile, key, &keylen) != 0)) {
+        exit (1);
+    }
+
+    if ((opts.group != NULL) && ((parse_addr (&group, opts.group, opts.family) != 0) ||
+                                 (!is_multicast (&group)))) {
+        log_error (0, "'%s' is not a multicast group\n", opts.group);
+        exit (1);
+    }
+
+    if (opts.daemon != 0) {
+        if (verbose != 0) {
+            print_options (&opts);
+        }
+        error = do_daemon (&opts);
+        free_options (&opts);
+        return (error);
+    }
+
+    if ((opts.action == FENCE_KDUMP_ACTION_OFF) ||
+        (opts.action == FENCE_KDUMP_ACTION_STATUS)) {
         if (opts.nodename == NULL) {
-            log_error (0, "action 'off' requires nodename\n");
+            log_error (0, "action '%s' requires nodename\n",
+                       (opts.action == FENCE_KDUMP_ACTION_OFF) ? "off" : "status");
+            exit (1);
+        }
+        clock_gettime (CLOCK_REALTIME, &stats.start);
+        if (get_options_nodes (&opts) != 0) {
             exit (1);
         }
-        if (get_options_node (&opts) != 0) {
-            log_error (0, "failed to get node '%s'\n", opts.nodename);
+        clock_gettime (CLOCK_REALTIME, &stats.resolved);
+
+        /* the group is joined on the socket the nodes of its family use */
+        if ((opts.group != NULL) && (!has_family (&opts, group.family))) {
+            log_error (0, "no node to receive from in the family of group '%s'\n",
+                       opts.group);
             exit (1);
         }
     }
@@ -496,7 +2443,16 @@ main (int argc, char **argv)
 
     switch (opts.action) {
     case FENCE_KDUMP_ACTION_OFF:
-        error = do_action_off (&opts);
+        error = do_action_off_shared (&opts);
+        if (opts.stats == FENCE_KDUMP_STATS_JSON) {
+            report_stats (&opts);
+        }
+        break;
+    case FENCE_KDUMP_ACTION_STATUS:
+        error = do_action_status (&opts);
+        break;
+    case FENCE_KDUMP_ACTION_MONITOR:
+        error = do_action_monitor (&opts);
         break;
     case FENCE_KDUMP_ACTION_METADATA:
         error = do_action_metadata (argv[0]);
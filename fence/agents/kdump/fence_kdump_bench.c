@@ -0,0 +1,690 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*-
+ *
+ * Copyright (c) Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "message.h"
+
+/*
+ * Load generator for fence_kdump on the loopback interface. Every round
+ * starts a number of agents on the same port, each fencing its share of
+ * the crashing nodes, which send a message every interval with some
+ * loss. Noise sources flood the port meanwhile, either as nodes that
+ * have already been fenced or as strangers the filter should drop. The
+ * time from the first message of the crashing nodes to each agent
+ * returning is collected over all rounds.
+ */
+
+#define BENCH_DEFAULT_IPPORT   17410
+#define BENCH_DEFAULT_CRASHING 1
+#define BENCH_DEFAULT_NOISE    16
+#define BENCH_DEFAULT_RATE     0
+#define BENCH_DEFAULT_INTERVAL 100
+#define BENCH_DEFAULT_LOSS     0
+#define BENCH_DEFAULT_AGENTS   1
+#define BENCH_DEFAULT_ROUNDS   10
+#define BENCH_DEFAULT_TIMEOUT  10
+#define BENCH_DEFAULT_AGENT    "./fence_kdump"
+#define BENCH_MAX_NODES        250
+#define BENCH_MAX_AGENTS       64
+#define BENCH_WARMUP           50
+
+/* crashing nodes send from 127.0.2.x, noise from 127.0.1.x */
+#define BENCH_CRASHING_NET     0x7F000200
+#define BENCH_NOISE_NET        0x7F000100
+
+typedef struct bench_opts {
+    int ipport;
+    int crashing;
+    int noise;
+    int listed;
+    int rate;
+    int interval;
+    int loss;
+    int agents;
+    int rounds;
+    int timeout;
+    int verbose;
+    const char *agent;
+} bench_opts_t;
+
+typedef struct bench_agent {
+    pid_t pid;
+    int status;
+    double latency;
+} bench_agent_t;
+
+typedef struct bench_result {
+    int count;
+    int failed;
+    double *latency;
+    unsigned long noise;
+    unsigned long sent;
+    unsigned long lost;
+    unsigned long drops;
+    double elapsed;
+} bench_result_t;
+
+static int verbose = 0;
+
+#define log_debug(lvl, fmt, args...)               \
+do {                                               \
+    if (lvl <= verbose)                            \
+        fprintf (stdout, "[debug]: " fmt, ##args); \
+} while (0);
+
+#define log_error(lvl, fmt, args...)               \
+do {                                               \
+    if (lvl <= verbose)                            \
+        fprintf (stderr, "[error]: " fmt, ##args); \
+} while (0);
+
+static double
+elapsed_ms (const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+
+    return ((now.tv_sec - start->tv_sec) * 1000.0 +
+            (now.tv_nsec - start->tv_nsec) / 1000000.0);
+}
+
+/* sum of the drop counters of all udp sockets bound to port */
+static unsigned long
+read_drops (int port)
+{
+    char buf[512];
+    char local[64];
+    unsigned long drops;
+    unsigned long total = 0;
+    unsigned int lport;
+    char *last;
+    FILE *file;
+    int i;
+
+    const char *files[] = { "/proc/net/udp", "/proc/net/udp6" };
+
+    for (i = 0; i < 2; i++) {
+        file = fopen (files[i], "r");
+        if (!file) {
+            continue;
+        }
+
+        while (fgets (buf, sizeof (buf), file) != NULL) {
+            if ((sscanf (buf, " %*d: %63s", local) != 1) ||
+                ((last = strrchr (local, ':')) == NULL) ||
+                (sscanf (last + 1, "%X", &lport) != 1) ||
+                ((int) lport != port)) {
+                continue;
+            }
+
+            buf[strcspn (buf, "\n")] = 0;
+            last = strrchr (buf, ' ');
+            if ((last != NULL) && (sscanf (last, "%lu", &drops) == 1)) {
+                total += drops;
+            }
+        }
+
+        fclose (file);
+    }
+
+    return (total);
+}
+
+static int
+is_bound (int port)
+{
+    char buf[512];
+    char local[64];
+    unsigned int lport;
+    char *last;
+    int found = 0;
+    FILE *file;
+
+    file = fopen ("/proc/net/udp", "r");
+    if (!file) {
+        return (0);
+    }
+
+    while ((!found) && (fgets (buf, sizeof (buf), file) != NULL)) {
+        if ((sscanf (buf, " %*d: %63s", local) == 1) &&
+            ((last = strrchr (local, ':')) != NULL) &&
+            (sscanf (last + 1, "%X", &lport) == 1) &&
+            ((int) lport == port)) {
+            found = 1;
+        }
+    }
+
+    fclose (file);
+
+    return (found);
+}
+
+static int
+open_sender (uint32_t addr)
+{
+    int sock;
+    struct sockaddr_in sin;
+
+    memset (&sin, 0, sizeof (sin));
+
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl (addr);
+
+    sock = socket (AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+    if (sock < 0) {
+        log_error (0, "socket (%s)\n", strerror (errno));
+        return (-1);
+    }
+
+    if (bind (sock, (struct sockaddr *) &sin, sizeof (sin)) != 0) {
+        log_error (0, "bind %s (%s)\n", inet_ntoa (sin.sin_addr), strerror (errno));
+        close (sock);
+        return (-1);
+    }
+
+    return (sock);
+}
+
+static void
+append_addr (char *buf, size_t len, uint32_t addr)
+{
+    struct in_addr in;
+
+    in.s_addr = htonl (addr);
+
+    snprintf (buf + strlen (buf), len - strlen (buf), "%s%s",
+              (buf[0] != 0) ? "," : "", inet_ntoa (in));
+}
+
+static pid_t
+start_agent (const bench_opts_t *opts, int index, const char *path)
+{
+    int i;
+    int fd;
+    pid_t pid;
+    char port[16];
+    char timeout[16];
+    char *nodes;
+    size_t len;
+
+    len = (opts->crashing + opts->noise + 1) * 16;
+    nodes = calloc (1, len);
+    if (!nodes) {
+        log_error (0, "calloc (%s)\n", strerror (errno));
+        return (-1);
+    }
+
+    /* each agent gets every n-th crashing node */
+    for (i = index; i < opts->crashing; i += opts->agents) {
+        append_addr (nodes, len, BENCH_CRASHING_NET + i + 1);
+    }
+    for (i = 0; (opts->listed) && (i < opts->noise); i++) {
+        append_addr (nodes, len, BENCH_NOISE_NET + i + 1);
+    }
+
+    snprintf (port, sizeof (port), "%d", opts->ipport);
+    snprintf (timeout, sizeof (timeout), "%d", opts->timeout);
+
+    pid = fork ();
+    if (pid == 0) {
+        if (opts->verbose < 2) {
+            fd = open ("/dev/null", O_WRONLY);
+            if (fd >= 0) {
+                dup2 (fd, STDOUT_FILENO);
+                close (fd);
+            }
+        }
+        execl (opts->agent, opts->agent, "-n", nodes, "-p", port, "-t", timeout,
+               "-S", path, (char *) NULL);
+        log_error (0, "exec '%s' (%s)\n", opts->agent, strerror (errno));
+        _exit (127);
+    }
+
+    free (nodes);
+
+    return (pid);
+}
+
+static int
+reap_agents (bench_agent_t *agents, int count, const struct timespec *start, int flags)
+{
+    int i;
+    int status;
+    int running = 0;
+    pid_t pid;
+
+    while ((pid = waitpid (-1, &status, flags)) > 0) {
+        for (i = 0; i < count; i++) {
+            if (agents[i].pid == pid) {
+                agents[i].pid = 0;
+                agents[i].status = status;
+                agents[i].latency = elapsed_ms (start);
+            }
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (agents[i].pid > 0) {
+            running++;
+        }
+    }
+
+    return (running);
+}
+
+static int
+send_noise (const bench_opts_t *opts, const int *noise, int *next, unsigned long *sent,
+            double now, const fence_kdump_msg_t *msg, const struct sockaddr_in *dst)
+{
+    if ((opts->noise == 0) ||
+        ((opts->rate > 0) && (*sent >= (unsigned long) (now * opts->rate / 1000)))) {
+        return (0);
+    }
+
+    if (sendto (noise[*next], msg, message_len (msg), 0,
+                (const struct sockaddr *) dst, sizeof (*dst)) > 0) {
+        (*sent)++;
+    }
+    *next = (*next + 1) % opts->noise;
+
+    return (1);
+}
+
+static int
+do_round (const bench_opts_t *opts, const int *crashing, const int *noise,
+          const char *path, bench_result_t *result)
+{
+    int i;
+    int n = 0;
+    int running;
+    unsigned long sent = 0;
+    unsigned long drops;
+    double now;
+    double next[BENCH_MAX_NODES];
+    struct timespec start;
+    struct sockaddr_in dst;
+    bench_agent_t agents[BENCH_MAX_AGENTS];
+    fence_kdump_msg_t msg;
+
+    init_message (&msg);
+
+    memset (&dst, 0, sizeof (dst));
+
+    dst.sin_family = AF_INET;
+    dst.sin_port = htons (opts->ipport);
+    dst.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+    memset (agents, 0, sizeof (agents));
+
+    /* the first agent takes the port, the others go through its query socket */
+    agents[0].pid = start_agent (opts, 0, path);
+    if (agents[0].pid < 0) {
+        return (1);
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    while (!is_bound (opts->ipport)) {
+        if ((elapsed_ms (&start) > 5000) || (reap_agents (agents, 1, &start, WNOHANG) == 0)) {
+            log_error (0, "agent did not start listening on port %d\n", opts->ipport);
+            kill (agents[0].pid, SIGTERM);
+            reap_agents (agents, 1, &start, 0);
+            return (1);
+        }
+        usleep (1000);
+    }
+
+    for (i = 1; i < opts->agents; i++) {
+        agents[i].pid = start_agent (opts, i, path);
+    }
+
+    /*
+     * listed noise sources are fenced by the first message of each, get
+     * that done so that only the crashing nodes are pending when timed
+     */
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    while ((now = elapsed_ms (&start)) < BENCH_WARMUP || (sent < (unsigned long) opts->noise)) {
+        if (send_noise (opts, noise, &n, &sent, now, &msg, &dst) == 0) {
+            usleep (100);
+        }
+    }
+    sent = 0;
+
+    drops = read_drops (opts->ipport);
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    for (i = 0; i < opts->crashing; i++) {
+        next[i] = 0;
+    }
+
+    running = opts->agents;
+    while (running > 0) {
+        now = elapsed_ms (&start);
+
+        for (i = 0; i < opts->crashing; i++) {
+            if (next[i] > now) {
+                continue;
+            }
+            next[i] += opts->interval;
+
+            if ((opts->loss > 0) && ((random () % 100) < opts->loss)) {
+                result->lost++;
+                continue;
+            }
+            if (sendto (crashing[i], &msg, message_len (&msg), 0,
+                        (struct sockaddr *) &dst, sizeof (dst)) > 0) {
+                result->sent++;
+            }
+        }
+
+        if (send_noise (opts, noise, &n, &sent, now, &msg, &dst) == 0) {
+            usleep (100);
+        }
+
+        /* checking on the agents is a system call, do not do it every packet */
+        if ((opts->rate == 0) && (opts->noise > 0) && ((sent % 256) != 0)) {
+            continue;
+        }
+        running = reap_agents (agents, opts->agents, &start, WNOHANG);
+    }
+
+    result->drops += read_drops (opts->ipport) - drops;
+    result->noise += sent;
+    result->elapsed += elapsed_ms (&start);
+
+    for (i = 0; i < opts->agents; i++) {
+        if (!WIFEXITED (agents[i].status) || (WEXITSTATUS (agents[i].status) != 0)) {
+            result->failed++;
+            continue;
+        }
+        result->latency[result->count++] = agents[i].latency;
+    }
+
+    return (0);
+}
+
+static int
+compare_double (const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return ((x > y) - (x < y));
+}
+
+static double
+percentile (const bench_result_t *result, int pct)
+{
+    int i;
+
+    if (result->count == 0) {
+        return (0);
+    }
+
+    i = ((result->count - 1) * pct + 50) / 100;
+
+    return (result->latency[i]);
+}
+
+static int
+do_bench (const bench_opts_t *opts)
+{
+    int i;
+    int error = 0;
+    int crashing[BENCH_MAX_NODES];
+    int noise[BENCH_MAX_NODES];
+    char path[64];
+    double cpu;
+    double self;
+    struct rusage usage;
+    bench_result_t result;
+
+    memset (&result, 0, sizeof (result));
+
+    result.latency = calloc (opts->rounds * opts->agents, sizeof (double));
+    if (!result.latency) {
+        log_error (0, "calloc (%s)\n", strerror (errno));
+        return (1);
+    }
+
+    for (i = 0; i < opts->crashing; i++) {
+        crashing[i] = open_sender (BENCH_CRASHING_NET + i + 1);
+        if (crashing[i] < 0) {
+            return (1);
+        }
+    }
+    for (i = 0; i < opts->noise; i++) {
+        noise[i] = open_sender (BENCH_NOISE_NET + i + 1);
+        if (noise[i] < 0) {
+            return (1);
+        }
+    }
+
+    snprintf (path, sizeof (path), "/tmp/fence_kdump_bench.%d.sock", getpid ());
+
+    srandom (getpid ());
+
+    log_debug (0, "%d rounds of %d agents, %d crashing nodes, %d %s noise sources\n",
+               opts->rounds, opts->agents, opts->crashing, opts->noise,
+               opts->listed ? "listed" : "unlisted");
+
+    for (i = 0; (i < opts->rounds) && (error == 0); i++) {
+        error = do_round (opts, crashing, noise, path, &result);
+        unlink (path);
+    }
+
+    for (i = 0; i < opts->crashing; i++) {
+        close (crashing[i]);
+    }
+    for (i = 0; i < opts->noise; i++) {
+        close (noise[i]);
+    }
+
+    /* only the agents have been waited for, so this is their cost alone */
+    getrusage (RUSAGE_CHILDREN, &usage);
+    cpu = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+          (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+
+    /* the agents share the cpus with this, a busy generator delays them */
+    getrusage (RUSAGE_SELF, &usage);
+    self = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+
+    qsort (result.latency, result.count, sizeof (double), compare_double);
+
+    fprintf (stdout, "agents fenced:      %d of %d\n",
+             result.count, result.count + result.failed);
+    fprintf (stdout, "messages sent:      %lu (%lu lost)\n", result.sent, result.lost);
+    fprintf (stdout, "noise sent:         %lu (%.0f/s)\n", result.noise,
+             (result.elapsed > 0) ? (result.noise * 1000.0 / result.elapsed) : 0);
+    fprintf (stdout, "kernel drops:       %lu\n", result.drops);
+    fprintf (stdout, "detect p50:         %.3f ms\n", percentile (&result, 50));
+    fprintf (stdout, "detect p90:         %.3f ms\n", percentile (&result, 90));
+    fprintf (stdout, "detect p99:         %.3f ms\n", percentile (&result, 99));
+    fprintf (stdout, "detect max:         %.3f ms\n", percentile (&result, 100));
+    fprintf (stdout, "agent cpu:          %.3f ms (%.3f ms per agent)\n", cpu,
+             cpu / (opts->rounds * opts->agents));
+    fprintf (stdout, "agent cpu per 1k:   %.3f ms\n",
+             (result.noise + result.sent > 0) ?
+             (cpu * 1000.0 / (result.noise + result.sent)) : 0);
+    fprintf (stdout, "generator cpu:      %.3f ms\n", self);
+
+    free (result.latency);
+
+    return ((error != 0) || (result.failed != 0));
+}
+
+static void
+print_usage (const char *self)
+{
+    fprintf (stdout, "Usage: %s [options]\n", basename (self));
+    fprintf (stdout, "\n");
+    fprintf (stdout, "Options:\n");
+    fprintf (stdout, "\n");
+    fprintf (stdout, "%s\n",
+             "  -p, --ipport=PORT            Port number (default: 17410)");
+    fprintf (stdout, "%s\n",
+             "  -n, --nodes=COUNT            Number of crashing nodes (default: 1)");
+    fprintf (stdout, "%s\n",
+             "  -m, --noise=COUNT            Number of noise sources (default: 16)");
+    fprintf (stdout, "%s\n",
+             "  -u, --unlisted               Noise sources are not among the fenced nodes");
+    fprintf (stdout, "%s\n",
+             "  -r, --rate=PPS               Noise rate, 0 is unlimited (default: 0)");
+    fprintf (stdout, "%s\n",
+             "  -i, --interval=MSEC          Interval of the crashing nodes (default: 100)");
+    fprintf (stdout, "%s\n",
+             "  -l, --loss=PERCENT           Messages of the crashing nodes lost (default: 0)");
+    fprintf (stdout, "%s\n",
+             "  -c, --concurrency=COUNT      Agents fencing at the same time (default: 1)");
+    fprintf (stdout, "%s\n",
+             "  -R, --rounds=COUNT           Number of rounds (default: 10)");
+    fprintf (stdout, "%s\n",
+             "  -t, --timeout=SECONDS        Timeout of the agents (default: 10)");
+    fprintf (stdout, "%s\n",
+             "  -a, --agent=PATH             fence_kdump binary (default: ./fence_kdump)");
+    fprintf (stdout, "%s\n",
+             "  -v, --verbose                Print verbose output");
+    fprintf (stdout, "%s\n",
+             "  -h, --help                   Print usage");
+    fprintf (stdout, "\n");
+
+    return;
+}
+
+int
+main (int argc, char **argv)
+{
+    int opt;
+    bench_opts_t opts;
+
+    struct option options[] = {
+        { "ipport",      required_argument, NULL, 'p' },
+        { "nodes",       required_argument, NULL, 'n' },
+        { "noise",       required_argument, NULL, 'm' },
+        { "unlisted",    no_argument,       NULL, 'u' },
+        { "rate",        required_argument, NULL, 'r' },
+        { "interval",    required_argument, NULL, 'i' },
+        { "loss",        required_argument, NULL, 'l' },
+        { "concurrency", required_argument, NULL, 'c' },
+        { "rounds",      required_argument, NULL, 'R' },
+        { "timeout",     required_argument, NULL, 't' },
+        { "agent",       required_argument, NULL, 'a' },
+        { "verbose",     optional_argument, NULL, 'v' },
+        { "help",        no_argument,       NULL, 'h' },
+        { 0, 0, 0, 0 }
+    };
+
+    opts.ipport   = BENCH_DEFAULT_IPPORT;
+    opts.crashing = BENCH_DEFAULT_CRASHING;
+    opts.noise    = BENCH_DEFAULT_NOISE;
+    opts.listed   = 1;
+    opts.rate     = BENCH_DEFAULT_RATE;
+    opts.interval = BENCH_DEFAULT_INTERVAL;
+    opts.loss     = BENCH_DEFAULT_LOSS;
+    opts.agents   = BENCH_DEFAULT_AGENTS;
+    opts.rounds   = BENCH_DEFAULT_ROUNDS;
+    opts.timeout  = BENCH_DEFAULT_TIMEOUT;
+    opts.verbose  = 0;
+    opts.agent    = BENCH_DEFAULT_AGENT;
+
+    while ((opt = getopt_long (argc, argv, "p:n:m:ur:i:l:c:R:t:a:v::h",
+                               options, NULL)) != EOF) {
+        switch (opt) {
+        case 'p':
+            opts.ipport = atoi (optarg);
+            break;
+        case 'n':
+            opts.crashing = atoi (optarg);
+            break;
+        case 'm':
+            opts.noise = atoi (optarg);
+            break;
+        case 'u':
+            opts.listed = 0;
+            break;
+        case 'r':
+            opts.rate = atoi (optarg);
+            break;
+        case 'i':
+            opts.interval = atoi (optarg);
+            break;
+        case 'l':
+            opts.loss = atoi (optarg);
+            break;
+        case 'c':
+            opts.agents = atoi (optarg);
+            break;
+        case 'R':
+            opts.rounds = atoi (optarg);
+            break;
+        case 't':
+            opts.timeout = atoi (optarg);
+            break;
+        case 'a':
+            opts.agent = optarg;
+            break;
+        case 'v':
+            opts.verbose = (optarg != NULL) ? atoi (optarg) : opts.verbose + 1;
+            break;
+        case 'h':
+            print_usage (argv[0]);
+            exit (0);
+        default:
+            print_usage (argv[0]);
+            exit (1);
+        }
+    }
+
+    if ((opts.crashing < 1) || (opts.crashing > BENCH_MAX_NODES) ||
+        (opts.noise < 0) || (opts.noise > BENCH_MAX_NODES) ||
+        (opts.agents < 1) || (opts.agents > BENCH_MAX_AGENTS) ||
+        (opts.agents > opts.crashing) ||
+        (opts.ipport < 1) || (opts.ipport > 65535) ||
+        (opts.rate < 0) || (opts.interval < 1) ||
+        (opts.loss < 0) || (opts.loss > 99) ||
+        (opts.rounds < 1) || (opts.timeout < 1)) {
+        print_usage (argv[0]);
+        exit (1);
+    }
+
+    verbose = opts.verbose;
+
+    return (do_bench (&opts));
+}
@@ -29,14 +29,30 @@
 #include <syslog.h>
 #include <ctype.h>
 #include <errno.h>
-#include <netdb.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <net/if.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <arpa/inet.h>
+#ifndef FENCE_KDUMP_STATIC
+#include <netdb.h>
+#endif
 
 #include "options.h"
 #include "message.h"
+#include "hmac.h"
 #include "version.h"
 
+#define FENCE_KDUMP_BACKOFF_JITTER 4
+#define FENCE_KDUMP_BOOTID_FILE    "/proc/sys/kernel/random/boot_id"
+
+typedef struct fence_kdump_dest {
+    int socket;
+    int count;
+    struct mmsghdr *hdr;
+} fence_kdump_dest_t;
+
 static int verbose = 0;
 
 #define log_debug(lvl, fmt, args...)               \
@@ -52,20 +68,187 @@ do {                                               \
 } while (0);
 
 static int
-send_message (const fence_kdump_node_t *node, void *msg, int len)
+send_messages (const fence_kdump_dest_t *dest)
 {
     int error;
+    int sent = 0;
+
+    while (sent < dest->count) {
+        error = sendmmsg (dest->socket, dest->hdr + sent, dest->count - sent, 0);
+        if (error < 0) {
+            /* skip the destination that failed and go on with the rest */
+            log_error (2, "sendmmsg (%s)\n", strerror (errno));
+            sent++;
+            continue;
+        }
+        sent += error;
+    }
 
-    error = sendto (node->socket, msg, len, 0, node->info->ai_addr, node->info->ai_addrlen);
-    if (error < 0) {
-        log_error (2, "sendto (%s)\n", strerror (errno));
-        goto out;
+    return (sent);
+}
+
+static int
+init_dests (const fence_kdump_opts_t *opts, fence_kdump_dest_t *dests,
+            struct mmsghdr *hdr, struct iovec *iov, int niov)
+{
+    int j;
+    int count = 0;
+    int i;
+    fence_kdump_node_t *node;
+
+    /* one socket and one sendmmsg call per address family */
+    list_for_each_entry (node, &opts->nodes, list) {
+        for (i = 0; i < count; i++) {
+            if (dests[i].socket == node->socket) {
+                break;
+            }
+        }
+        if (i == count) {
+            dests[count].socket = node->socket;
+            dests[count].count = 0;
+            count++;
+        }
     }
 
-    log_debug (1, "message sent to node '%s'\n", node->addr);
+    for (i = 0; i < count; i++) {
+        dests[i].hdr = hdr;
 
-out:
-    return (error);
+        list_for_each_entry (node, &opts->nodes, list) {
+            if (node->socket != dests[i].socket) {
+                continue;
+            }
+
+            /* every node gets each message version that is being sent */
+            for (j = 0; j < niov; j++) {
+                memset (hdr, 0, sizeof (*hdr));
+
+                hdr->msg_hdr.msg_name = &node->sa;
+                hdr->msg_hdr.msg_namelen = node->salen;
+                hdr->msg_hdr.msg_iov = &iov[j];
+                hdr->msg_hdr.msg_iovlen = 1;
+
+                dests[i].count++;
+                hdr++;
+            }
+        }
+    }
+
+    return (count);
+}
+
+static void
+read_bootid (uint8_t *bootid)
+{
+    int i = 0;
+    int c;
+    char hex[3] = { 0, 0, 0 };
+    FILE *file;
+
+    /* the boot id of the capture kernel tells one crash from the next */
+    file = fopen (FENCE_KDUMP_BOOTID_FILE, "r");
+    if (file) {
+        while ((i < FENCE_KDUMP_BOOTID_LEN * 2) && ((c = fgetc (file)) != EOF)) {
+            if (!isxdigit (c)) {
+                continue;
+            }
+            hex[i % 2] = c;
+            if (i % 2) {
+                bootid[i / 2] = strtoul (hex, NULL, 16);
+            }
+            i++;
+        }
+        fclose (file);
+    }
+
+    for (i /= 2; i < FENCE_KDUMP_BOOTID_LEN; i++) {
+        bootid[i] = random ();
+    }
+}
+
+static void
+read_progress (const fence_kdump_opts_t *opts, fence_kdump_msg_t *msg)
+{
+    int phase;
+    unsigned int progress = 0;
+    char name[32];
+    FILE *file;
+
+    if (opts->progress == NULL) {
+        return;
+    }
+
+    /* written by the dump scripts as "PHASE [PERCENT]" */
+    file = fopen (opts->progress, "r");
+    if (!file) {
+        return;
+    }
+
+    if (fscanf (file, "%31s %u", name, &progress) >= 1) {
+        phase = parse_phase (name);
+        if (phase >= 0) {
+            msg->phase = phase;
+            msg->progress = (progress > 100) ? 100 : progress;
+        }
+    }
+
+    fclose (file);
+}
+
+static void
+update_message (const fence_kdump_opts_t *opts, fence_kdump_msg_t *msg,
+                const uint8_t *key, size_t keylen)
+{
+    msg->seqno = htonl (ntohl (msg->seqno) + 1);
+
+    read_progress (opts, msg);
+
+    msg->sent = htonl (time (NULL));
+
+    if (keylen > 0) {
+        msg->flags = htons (FENCE_KDUMP_FLAG_HMAC);
+        hmac_sha256 (key, keylen, msg, offsetof (fence_kdump_msg_t, hmac), msg->hmac);
+    }
+}
+
+/* time to wait before the next round of messages, in milliseconds */
+static int
+next_wait (const fence_kdump_opts_t *opts, int elapsed, int *backoff)
+{
+    int wait;
+
+    if (opts->burst_interval == 0) {
+        return (opts->interval);
+    }
+
+    if (elapsed < opts->burst_duration) {
+        return (opts->burst_interval);
+    }
+
+    if (*backoff >= opts->interval) {
+        return (opts->interval);
+    }
+
+    /* after the burst back off exponentially, with jitter, up to interval */
+    *backoff = (*backoff == 0) ? (opts->burst_interval * 2) : (*backoff * 2);
+    if (*backoff > opts->interval) {
+        *backoff = opts->interval;
+    }
+
+    wait = *backoff - (random () % ((*backoff / FENCE_KDUMP_BACKOFF_JITTER) + 1));
+
+    return (wait);
+}
+
+static void
+add_msec (struct timespec *ts, int msec)
+{
+    ts->tv_sec += msec / 1000;
+    ts->tv_nsec += (msec % 1000) * 1000000L;
+
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec += 1;
+        ts->tv_nsec -= 1000000000L;
+    }
 }
 
 static void
@@ -82,7 +265,23 @@ print_usage (const char *self)
     fprintf (stdout, "%s\n",
              "  -c, --count=COUNT            Number of messages to send (default: 0)");
     fprintf (stdout, "%s\n",
-             "  -i, --interval=INTERVAL      Interval in seconds (default: 10)");
+             "  -i, --interval=INTERVAL      Interval in seconds or with ms suffix (default: 10)");
+    fprintf (stdout, "%s\n",
+             "  -b, --burst=INTERVAL,TIME    Send every INTERVAL for TIME first, then back off");
+    fprintf (stdout, "%s\n",
+             "  -P, --protocol=VERSION       Message version: ([auto], 1, 2)");
+    fprintf (stdout, "%s\n",
+             "  -I, --nodeid=ID              Node id sent in version 2 messages (default: 0)");
+    fprintf (stdout, "%s\n",
+             "  -k, --key-file=FILE          Authenticate messages with the key in FILE");
+    fprintf (stdout, "%s\n",
+             "  -r, --progress-file=FILE     Read dump phase and progress from FILE");
+    fprintf (stdout, "%s\n",
+             "  -C, --config=FILE            Read node addresses from FILE");
+    fprintf (stdout, "%s\n",
+             "  -T, --ttl=HOPS               Hops of messages to multicast groups (default: 1)");
+    fprintf (stdout, "%s\n",
+             "  -m, --interface=IFACE        Send to multicast groups through IFACE");
     fprintf (stdout, "%s\n",
              "  -v, --verbose                Print verbose output");
     fprintf (stdout, "%s\n",
@@ -95,19 +294,48 @@ print_usage (const char *self)
 }
 
 static int
-get_options_node (fence_kdump_opts_t *opts)
+parse_node (const fence_kdump_opts_t *opts, fence_kdump_node_t *node)
+{
+    struct sockaddr_in *sin = (struct sockaddr_in *) &node->sa;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &node->sa;
+
+    if ((opts->family != AF_INET6) &&
+        (inet_pton (AF_INET, node->name, &sin->sin_addr) == 1)) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons (opts->ipport);
+        node->salen = sizeof (*sin);
+        return (0);
+    }
+
+    if ((opts->family != AF_INET) &&
+        (inet_pton (AF_INET6, node->name, &sin6->sin6_addr) == 1)) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons (opts->ipport);
+        node->salen = sizeof (*sin6);
+        return (0);
+    }
+
+    return (1);
+}
+
+static int
+resolve_node (const fence_kdump_opts_t *opts, fence_kdump_node_t *node)
 {
+#ifndef FENCE_KDUMP_STATIC
     int error;
     struct addrinfo hints;
-    fence_kdump_node_t *node;
+    struct addrinfo *info;
+#endif
 
-    node = malloc (sizeof (fence_kdump_node_t));
-    if (!node) {
-        log_error (2, "malloc (%s)\n", strerror (errno));
-        return (1);
+    /* numeric addresses never touch the resolver */
+    if (parse_node (opts, node) == 0) {
+        return (0);
     }
 
-    memset (node, 0, sizeof (fence_kdump_node_t));
+#ifdef FENCE_KDUMP_STATIC
+    log_error (2, "'%s' is not a numeric address\n", node->name);
+    return (1);
+#else
     memset (&hints, 0, sizeof (hints));
 
     hints.ai_family = opts->family;
@@ -115,41 +343,170 @@ get_options_node (fence_kdump_opts_t *opts)
     hints.ai_protocol = IPPROTO_UDP;
     hints.ai_flags = AI_NUMERICSERV;
 
-    strncpy (node->name, opts->nodename, sizeof (node->name));
-    snprintf (node->port, sizeof (node->port), "%d", opts->ipport);
-
-    node->info = NULL;
-    error = getaddrinfo (node->name, node->port, &hints, &node->info);
+    error = getaddrinfo (node->name, node->port, &hints, &info);
     if (error != 0) {
         log_error (2, "getaddrinfo (%s)\n", gai_strerror (error));
-        free_node (node);
         return (1);
     }
 
-    error = getnameinfo (node->info->ai_addr, node->info->ai_addrlen,
-                         node->addr, sizeof (node->addr),
-                         node->port, sizeof (node->port),
-                         NI_NUMERICHOST | NI_NUMERICSERV);
+    memcpy (&node->sa, info->ai_addr, info->ai_addrlen);
+    node->salen = info->ai_addrlen;
+
+    freeaddrinfo (info);
+
+    return (0);
+#endif
+}
+
+static int
+set_node_scope (const fence_kdump_opts_t *opts, fence_kdump_node_t *node)
+{
+    int on = 1;
+    int error = 0;
+    unsigned int ifindex = 0;
+    struct ip_mreqn mreq;
+    struct sockaddr_in *sin = (struct sockaddr_in *) &node->sa;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &node->sa;
+
+    /* a broadcast address is only known to the kernel, so always allow it */
+    if (node->sa.ss_family == AF_INET) {
+        setsockopt (node->socket, SOL_SOCKET, SO_BROADCAST, &on, sizeof (on));
+    }
+
+    if (((node->sa.ss_family == AF_INET) && !IN_MULTICAST (ntohl (sin->sin_addr.s_addr))) ||
+        ((node->sa.ss_family == AF_INET6) && !IN6_IS_ADDR_MULTICAST (&sin6->sin6_addr))) {
+        return (0);
+    }
+
+    if (opts->interface != NULL) {
+        ifindex = if_nametoindex (opts->interface);
+        if (ifindex == 0) {
+            log_error (0, "unknown interface '%s'\n", opts->interface);
+            return (1);
+        }
+    }
+
+    if (node->sa.ss_family == AF_INET) {
+        memset (&mreq, 0, sizeof (mreq));
+        mreq.imr_ifindex = ifindex;
+
+        error |= setsockopt (node->socket, IPPROTO_IP, IP_MULTICAST_TTL,
+                             &opts->ttl, sizeof (opts->ttl));
+        if (ifindex != 0) {
+            error |= setsockopt (node->socket, IPPROTO_IP, IP_MULTICAST_IF,
+                                 &mreq, sizeof (mreq));
+        }
+    } else {
+        error |= setsockopt (node->socket, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
+                             &opts->ttl, sizeof (opts->ttl));
+        if (ifindex != 0) {
+            error |= setsockopt (node->socket, IPPROTO_IPV6, IPV6_MULTICAST_IF,
+                                 &ifindex, sizeof (ifindex));
+        }
+    }
+
     if (error != 0) {
-        log_error (2, "getnameinfo (%s)\n", gai_strerror (error));
-        free_node (node);
+        log_error (2, "setsockopt (%s)\n", strerror (errno));
         return (1);
     }
 
-    node->socket = socket (node->info->ai_family,
-                           node->info->ai_socktype,
-                           node->info->ai_protocol);
-    if (node->socket < 0) {
-        log_error (2, "socket (%s)\n", strerror (errno));
+    return (0);
+}
+
+static int
+get_options_node (fence_kdump_opts_t *opts)
+{
+    const void *addr;
+    fence_kdump_node_t *node;
+    fence_kdump_node_t *peer;
+
+    node = malloc (sizeof (fence_kdump_node_t));
+    if (!node) {
+        log_error (2, "malloc (%s)\n", strerror (errno));
+        return (1);
+    }
+
+    memset (node, 0, sizeof (fence_kdump_node_t));
+
+    init_node (node);
+
+    strncpy (node->name, opts->nodename, sizeof (node->name) - 1);
+    snprintf (node->port, sizeof (node->port), "%d", opts->ipport);
+
+    if (resolve_node (opts, node) != 0) {
         free_node (node);
         return (1);
     }
 
+    if (node->sa.ss_family == AF_INET) {
+        addr = &((struct sockaddr_in *) &node->sa)->sin_addr;
+    } else {
+        addr = &((struct sockaddr_in6 *) &node->sa)->sin6_addr;
+    }
+    inet_ntop (node->sa.ss_family, addr, node->addr, sizeof (node->addr));
+
+    /* nodes of the same family are sent to through one socket */
+    list_for_each_entry (peer, &opts->nodes, list) {
+        if (peer->sa.ss_family == node->sa.ss_family) {
+            node->socket = peer->socket;
+            break;
+        }
+    }
+
+    if (node->socket < 0) {
+        node->socket = socket (node->sa.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+        if (node->socket < 0) {
+            log_error (2, "socket (%s)\n", strerror (errno));
+            free_node (node);
+            return (1);
+        }
+    }
+
+    /* without the multicast settings the defaults still reach the link */
+    set_node_scope (opts, node);
+
     list_add_tail (&node->list, &opts->nodes);
 
     return (0);
 }
 
+static int
+get_options_config (fence_kdump_opts_t *opts, const char *path)
+{
+    int error = 0;
+    char buf[FENCE_KDUMP_NAME_LEN];
+    char *name;
+    char *save;
+    FILE *file;
+
+    file = fopen (path, "r");
+    if (!file) {
+        log_error (0, "failed to open '%s' (%s)\n", path, strerror (errno));
+        return (1);
+    }
+
+    /* one or more addresses per line, as written by the initramfs generator */
+    while (fgets (buf, sizeof (buf), file) != NULL) {
+        if (buf[0] == '#') {
+            continue;
+        }
+
+        for (name = strtok_r (buf, " \t\r\n", &save); name != NULL;
+             name = strtok_r (NULL, " \t\r\n", &save)) {
+            opts->nodename = name;
+            if (get_options_node (opts) != 0) {
+                log_error (1, "failed to get node '%s'\n", name);
+                error = 1;
+            }
+            opts->nodename = NULL;
+        }
+    }
+
+    fclose (file);
+
+    return (error);
+}
+
 static void
 get_options (int argc, char **argv, fence_kdump_opts_t *opts)
 {
@@ -160,13 +517,21 @@ get_options (int argc, char **argv, fence_kdump_opts_t *opts)
         { "family",   required_argument, NULL, 'f' },
         { "count",    required_argument, NULL, 'c' },
         { "interval", required_argument, NULL, 'i' },
+        { "burst",    required_argument, NULL, 'b' },
+        { "protocol", required_argument, NULL, 'P' },
+        { "nodeid",   required_argument, NULL, 'I' },
+        { "key-file", required_argument, NULL, 'k' },
+        { "progress-file", required_argument, NULL, 'r' },
+        { "config",   required_argument, NULL, 'C' },
+        { "ttl",      required_argument, NULL, 'T' },
+        { "interface", required_argument, NULL, 'm' },
         { "verbose",  optional_argument, NULL, 'v' },
         { "version",  no_argument,       NULL, 'V' },
         { "help",     no_argument,       NULL, 'h' },
         { 0, 0, 0, 0 }
     };
 
-    while ((opt = getopt_long (argc, argv, "p:f:c:i:v::Vh", options, NULL)) != EOF) {
+    while ((opt = getopt_long (argc, argv, "p:f:c:i:b:P:I:k:r:C:T:m:v::Vh", options, NULL)) != EOF) {
         switch (opt) {
         case 'p':
             set_option_ipport (opts, optarg);
@@ -180,6 +545,30 @@ get_options (int argc, char **argv, fence_kdump_opts_t *opts)
         case 'i':
             set_option_interval (opts, optarg);
             break;
+        case 'b':
+            set_option_burst (opts, optarg);
+            break;
+        case 'P':
+            set_option_protocol (opts, optarg);
+            break;
+        case 'I':
+            set_option_nodeid (opts, optarg);
+            break;
+        case 'k':
+            set_option_keyfile (opts, optarg);
+            break;
+        case 'r':
+            set_option_progress (opts, optarg);
+            break;
+        case 'T':
+            set_option_ttl (opts, optarg);
+            break;
+        case 'm':
+            set_option_interface (opts, optarg);
+            break;
+        case 'C':
+            set_option_config (opts, optarg);
+            break;
         case 'v':
             set_option_verbose (opts, optarg);
             break;
@@ -204,10 +593,28 @@ int
 main (int argc, char **argv)
 {
     int count = 1;
+    int ndests;
+    int nnodes = 0;
+    int backoff = 0;
+    int sent = 0;
+    int i;
+    int niov = 0;
+    size_t keylen = 0;
+    uint8_t key[FENCE_KDUMP_KEY_MAX];
+    struct iovec iov[2];
+    struct timespec launch;
+    struct timespec start;
+    struct timespec now;
+    struct timespec next;
+    struct mmsghdr *hdr;
+    fence_kdump_dest_t dests[2];
     fence_kdump_msg_t msg;
+    fence_kdump_msg_t msgv1;
     fence_kdump_opts_t opts;
     fence_kdump_node_t *node;
 
+    clock_gettime (CLOCK_MONOTONIC, &launch);
+
     init_options (&opts);
 
     if (argc > 1) {
@@ -225,6 +632,10 @@ main (int argc, char **argv)
         opts.nodename = NULL;
     }
 
+    if (opts.config != NULL) {
+        get_options_config (&opts, opts.config);
+    }
+
     if (list_empty (&opts.nodes)) {
         print_usage (argv[0]);
         exit (1);
@@ -234,20 +645,95 @@ main (int argc, char **argv)
         print_options (&opts);
     }
 
+    /* version 1 messages carry no HMAC, the key would silently be dropped */
+    if ((opts.keyfile != NULL) && (opts.protocol == FENCE_KDUMP_MSGV1)) {
+        log_error (0, "version 1 messages cannot be authenticated with '%s'\n",
+                   opts.keyfile);
+        exit (1);
+    }
+
+    if ((opts.keyfile != NULL) && (read_key_file (opts.keyfile, key, &keylen) != 0)) {
+        exit (1);
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    srandom (start.tv_nsec ^ getpid ());
+
     init_message (&msg);
+    init_message (&msgv1);
+
+    msg.version = FENCE_KDUMP_MSGV2;
+    msg.nodeid = htonl (opts.nodeid);
+    msg.phase = FENCE_KDUMP_PHASE_STARTING;
+    read_bootid (msg.bootid);
+
+    /* keep counting up if the sender is restarted within the same boot */
+    msg.seqno = htonl (start.tv_sec * 1000 + start.tv_nsec / 1000000);
+
+    /*
+     * There is no way back from the fencing nodes, so unless told
+     * otherwise send both versions, the newer first. Fencing nodes that
+     * know version 2 act on it and older ones still get a message they
+     * understand. An authenticated sender only sends version 2.
+     */
+    if (opts.protocol != FENCE_KDUMP_MSGV1) {
+        iov[niov].iov_base = &msg;
+        iov[niov].iov_len = message_len (&msg);
+        niov++;
+    }
+    if ((opts.protocol == FENCE_KDUMP_MSGV1) ||
+        ((opts.protocol == 0) && (keylen == 0))) {
+        iov[niov].iov_base = &msgv1;
+        iov[niov].iov_len = message_len (&msgv1);
+        niov++;
+    }
+
+    list_for_each_entry (node, &opts.nodes, list) {
+        nnodes++;
+    }
+
+    hdr = calloc (nnodes * niov, sizeof (struct mmsghdr));
+    if (!hdr) {
+        log_error (0, "calloc (%s)\n", strerror (errno));
+        exit (1);
+    }
+
+    ndests = init_dests (&opts, dests, hdr, iov, niov);
+
+    next = start;
 
     for (;;) {
+        update_message (&opts, &msg, key, keylen);
+
+        for (i = 0; i < ndests; i++) {
+            send_messages (&dests[i]);
+        }
+
+        if (!sent) {
+            sent = 1;
+            clock_gettime (CLOCK_MONOTONIC, &now);
+            log_debug (1, "first message sent %ld us after start\n",
+                       (long) ((now.tv_sec - launch.tv_sec) * 1000000 +
+                               (now.tv_nsec - launch.tv_nsec) / 1000));
+        }
+
         list_for_each_entry (node, &opts.nodes, list) {
-            send_message (node, &msg, sizeof (msg));
+            log_debug (1, "message sent to node '%s'\n", node->addr);
         }
 
         if ((opts.count != 0) && (++count > opts.count)) {
             break;
         }
 
-        sleep (opts.interval);
+        /* schedule against the start time so that sends do not drift */
+        clock_gettime (CLOCK_MONOTONIC, &now);
+        add_msec (&next, next_wait (&opts, (now.tv_sec - start.tv_sec) * 1000 +
+                                    (now.tv_nsec - start.tv_nsec) / 1000000, &backoff));
+
+        while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
     }
 
+    free (hdr);
     free_options (&opts);
 
     return (0);
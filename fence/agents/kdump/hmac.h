@@ -0,0 +1,237 @@
+/* -*- mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*-
+ *
+ * Copyright (c) Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _FENCE_KDUMP_HMAC_H
+#define _FENCE_KDUMP_HMAC_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * HMAC-SHA256 (RFC 2104, FIPS 180-4) for authenticating messages. It is
+ * kept here so that fence_kdump_send does not pull a crypto library into
+ * the kdump initramfs.
+ */
+
+#define FENCE_KDUMP_SHA256_LEN   32
+#define FENCE_KDUMP_SHA256_BLOCK 64
+#define FENCE_KDUMP_KEY_MAX      1024
+
+typedef struct fence_kdump_sha256 {
+    uint32_t state[8];
+    uint64_t length;
+    size_t used;
+    uint8_t block[FENCE_KDUMP_SHA256_BLOCK];
+} fence_kdump_sha256_t;
+
+static const uint32_t fence_kdump_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static inline void
+sha256_transform (fence_kdump_sha256_t *ctx, const uint8_t *data)
+{
+    int i;
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+    uint32_t t1, t2;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = ((uint32_t) data[i * 4] << 24) | ((uint32_t) data[i * 4 + 1] << 16) |
+               ((uint32_t) data[i * 4 + 2] << 8) | ((uint32_t) data[i * 4 + 3]);
+    }
+    for (i = 16; i < 64; i++) {
+        w[i] = (SHA256_ROR (w[i - 2], 17) ^ SHA256_ROR (w[i - 2], 19) ^ (w[i - 2] >> 10)) +
+               w[i - 7] +
+               (SHA256_ROR (w[i - 15], 7) ^ SHA256_ROR (w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+               w[i - 16];
+    }
+
+    a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+    e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+
+    for (i = 0; i < 64; i++) {
+        t1 = h + (SHA256_ROR (e, 6) ^ SHA256_ROR (e, 11) ^ SHA256_ROR (e, 25)) +
+             ((e & f) ^ (~e & g)) + fence_kdump_sha256_k[i] + w[i];
+        t2 = (SHA256_ROR (a, 2) ^ SHA256_ROR (a, 13) ^ SHA256_ROR (a, 22)) +
+             ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+static inline void
+sha256_init (fence_kdump_sha256_t *ctx)
+{
+    ctx->state[0] = 0x6a09e667; ctx->state[1] = 0xbb67ae85;
+    ctx->state[2] = 0x3c6ef372; ctx->state[3] = 0xa54ff53a;
+    ctx->state[4] = 0x510e527f; ctx->state[5] = 0x9b05688c;
+    ctx->state[6] = 0x1f83d9ab; ctx->state[7] = 0x5be0cd19;
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+static inline void
+sha256_update (fence_kdump_sha256_t *ctx, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    ctx->length += len;
+
+    while (len > 0) {
+        ctx->block[ctx->used++] = *p++;
+        len--;
+
+        if (ctx->used == FENCE_KDUMP_SHA256_BLOCK) {
+            sha256_transform (ctx, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+static inline void
+sha256_final (fence_kdump_sha256_t *ctx, uint8_t *digest)
+{
+    int i;
+    uint64_t bits = ctx->length * 8;
+
+    ctx->block[ctx->used++] = 0x80;
+
+    if (ctx->used > FENCE_KDUMP_SHA256_BLOCK - 8) {
+        memset (ctx->block + ctx->used, 0, FENCE_KDUMP_SHA256_BLOCK - ctx->used);
+        sha256_transform (ctx, ctx->block);
+        ctx->used = 0;
+    }
+
+    memset (ctx->block + ctx->used, 0, FENCE_KDUMP_SHA256_BLOCK - 8 - ctx->used);
+    for (i = 0; i < 8; i++) {
+        ctx->block[FENCE_KDUMP_SHA256_BLOCK - 1 - i] = (uint8_t) (bits >> (i * 8));
+    }
+    sha256_transform (ctx, ctx->block);
+
+    for (i = 0; i < 8; i++) {
+        digest[i * 4]     = (uint8_t) (ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t) (ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t) (ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t) (ctx->state[i]);
+    }
+}
+
+static inline void
+hmac_sha256 (const uint8_t *key, size_t keylen,
+             const void *data, size_t len, uint8_t *digest)
+{
+    int i;
+    uint8_t pad[FENCE_KDUMP_SHA256_BLOCK];
+    uint8_t hash[FENCE_KDUMP_SHA256_LEN];
+    fence_kdump_sha256_t ctx;
+
+    memset (pad, 0, sizeof (pad));
+
+    if (keylen > FENCE_KDUMP_SHA256_BLOCK) {
+        sha256_init (&ctx);
+        sha256_update (&ctx, key, keylen);
+        sha256_final (&ctx, pad);
+    } else {
+        memcpy (pad, key, keylen);
+    }
+
+    for (i = 0; i < FENCE_KDUMP_SHA256_BLOCK; i++) {
+        pad[i] ^= 0x36;
+    }
+
+    sha256_init (&ctx);
+    sha256_update (&ctx, pad, sizeof (pad));
+    sha256_update (&ctx, data, len);
+    sha256_final (&ctx, hash);
+
+    for (i = 0; i < FENCE_KDUMP_SHA256_BLOCK; i++) {
+        pad[i] ^= 0x36 ^ 0x5c;
+    }
+
+    sha256_init (&ctx);
+    sha256_update (&ctx, pad, sizeof (pad));
+    sha256_update (&ctx, hash, sizeof (hash));
+    sha256_final (&ctx, digest);
+}
+
+/* compare in constant time so that the digest cannot be guessed byte by byte */
+static inline int
+hmac_equal (const uint8_t *a, const uint8_t *b, size_t len)
+{
+    size_t i;
+    uint8_t diff = 0;
+
+    for (i = 0; i < len; i++) {
+        diff |= a[i] ^ b[i];
+    }
+
+    return (diff == 0);
+}
+
+static inline int
+read_key_file (const char *path, uint8_t *key, size_t *keylen)
+{
+    int more;
+    FILE *file;
+
+    file = fopen (path, "r");
+    if (!file) {
+        fprintf (stderr, "[error]: failed to open key file '%s' (%s)\n",
+                 path, strerror (errno));
+        return (1);
+    }
+
+    *keylen = fread (key, 1, FENCE_KDUMP_KEY_MAX, file);
+    more = (fgetc (file) != EOF);
+
+    fclose (file);
+
+    /* a truncated key would not match the one of the other side */
+    if (more) {
+        fprintf (stderr, "[error]: key file '%s' is longer than %d bytes\n",
+                 path, FENCE_KDUMP_KEY_MAX);
+        return (1);
+    }
+
+    if (*keylen == 0) {
+        fprintf (stderr, "[error]: key file '%s' is empty\n", path);
+        return (1);
+    }
+
+    return (0);
+}
+
+#endif /* _FENCE_KDUMP_HMAC_H */
@@ -25,17 +25,86 @@
 #define FENCE_KDUMP_MAGIC 0x1B302A40
 
 #define FENCE_KDUMP_MSGV1 0x1
+#define FENCE_KDUMP_MSGV2 0x2
 
+#define FENCE_KDUMP_BOOTID_LEN 16
+#define FENCE_KDUMP_HMAC_LEN   32
+
+#define FENCE_KDUMP_FLAG_HMAC  0x1
+
+enum {
+    FENCE_KDUMP_PHASE_UNKNOWN  = 0,
+    FENCE_KDUMP_PHASE_STARTING = 1,
+    FENCE_KDUMP_PHASE_DUMPING  = 2,
+    FENCE_KDUMP_PHASE_SAVED    = 3,
+    FENCE_KDUMP_PHASE_FAILED   = 4,
+};
+
+/*
+ * Version 1 messages consist of the magic number and the version only,
+ * both in host byte order. Version 2 appends the fields below, which are
+ * in network byte order. The hmac covers everything in front of it,
+ * including the time the message was sent (seconds since the epoch), so
+ * that an authenticated message cannot be replayed later.
+ */
 typedef struct __attribute__ ((packed)) fence_kdump_msg {
     uint32_t magic;
     uint32_t version;
+    uint32_t nodeid;
+    uint32_t seqno;
+    uint8_t bootid[FENCE_KDUMP_BOOTID_LEN];
+    uint8_t phase;
+    uint8_t progress;
+    uint16_t flags;
+    uint32_t sent;
+    uint8_t hmac[FENCE_KDUMP_HMAC_LEN];
 } fence_kdump_msg_t;
 
+#define FENCE_KDUMP_MSGV1_LEN offsetof (fence_kdump_msg_t, nodeid)
+#define FENCE_KDUMP_MSGV2_LEN sizeof (fence_kdump_msg_t)
+
+static const char *fence_kdump_phases[] = {
+    "unknown", "starting", "dumping", "saved", "failed",
+};
+
 static inline void
 init_message (fence_kdump_msg_t *msg)
 {
+    memset (msg, 0, sizeof (*msg));
+
     msg->magic   = FENCE_KDUMP_MAGIC;
     msg->version = FENCE_KDUMP_MSGV1;
 }
 
+static inline size_t
+message_len (const fence_kdump_msg_t *msg)
+{
+    return ((msg->version == FENCE_KDUMP_MSGV1) ?
+            FENCE_KDUMP_MSGV1_LEN : FENCE_KDUMP_MSGV2_LEN);
+}
+
+static inline const char *
+message_phase (const fence_kdump_msg_t *msg)
+{
+    if (msg->phase >= sizeof (fence_kdump_phases) / sizeof (fence_kdump_phases[0])) {
+        return (fence_kdump_phases[FENCE_KDUMP_PHASE_UNKNOWN]);
+    }
+
+    return (fence_kdump_phases[msg->phase]);
+}
+
+static inline int
+parse_phase (const char *arg)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof (fence_kdump_phases) / sizeof (fence_kdump_phases[0]); i++) {
+        if (!strcasecmp (arg, fence_kdump_phases[i])) {
+            return (i);
+        }
+    }
+
+    return (-1);
+}
+
 #endif /* _FENCE_KDUMP_MESSAGE_H */
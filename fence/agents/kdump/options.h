@@ -44,6 +44,17 @@ enum {
     FENCE_KDUMP_FAMILY_IPV4 = AF_INET,
 };
 
+enum {
+    FENCE_KDUMP_STATS_NONE = 0,
+    FENCE_KDUMP_STATS_JSON = 1,
+};
+
+enum {
+    FENCE_KDUMP_NODE_WAITING = 0,
+    FENCE_KDUMP_NODE_FENCED  = 1,
+    FENCE_KDUMP_NODE_TIMEOUT = 2,
+};
+
 #define FENCE_KDUMP_DEFAULT_IPPORT   7410
 #define FENCE_KDUMP_DEFAULT_FAMILY   0
 #define FENCE_KDUMP_DEFAULT_ACTION   0
@@ -51,6 +62,21 @@ enum {
 #define FENCE_KDUMP_DEFAULT_INTERVAL 10
 #define FENCE_KDUMP_DEFAULT_TIMEOUT  60
 #define FENCE_KDUMP_DEFAULT_VERBOSE  0
+#define FENCE_KDUMP_DEFAULT_MAX_AGE  (FENCE_KDUMP_DEFAULT_INTERVAL * 2)
+#define FENCE_KDUMP_DEFAULT_PROTOCOL 0
+#define FENCE_KDUMP_DEFAULT_NODEID   0
+#define FENCE_KDUMP_DEFAULT_TTL      1
+
+#ifndef CLUSTERVARRUN
+#define CLUSTERVARRUN "/var/run/cluster"
+#endif
+
+#define FENCE_KDUMP_DEFAULT_SOCKET   CLUSTERVARRUN "/fence_kdump.sock"
+
+typedef struct fence_kdump_addr {
+    int family;
+    uint8_t data[16];
+} fence_kdump_addr_t;
 
 typedef struct fence_kdump_opts {
     char *nodename;
@@ -59,8 +85,23 @@ typedef struct fence_kdump_opts {
     int action;
     int count;
     int interval;
+    int burst_interval;
+    int burst_duration;
     int timeout;
     int verbose;
+    int daemon;
+    int max_age;
+    char *socket;
+    char *hosts;
+    int protocol;
+    uint32_t nodeid;
+    char *keyfile;
+    char *progress;
+    char *config;
+    int stats;
+    char *group;
+    char *interface;
+    int ttl;
     struct list_head nodes;
 } fence_kdump_opts_t;
 
@@ -68,21 +109,27 @@ typedef struct fence_kdump_node {
     char name[FENCE_KDUMP_NAME_LEN];
     char addr[FENCE_KDUMP_ADDR_LEN];
     char port[FENCE_KDUMP_PORT_LEN];
+    fence_kdump_addr_t ip;
     int socket;
-    struct addrinfo *info;
+    int state;
+    struct timespec deadline;
+    struct timespec stamp;
+    struct sockaddr_storage sa;
+    socklen_t salen;
     struct list_head list;
 } fence_kdump_node_t;
 
 static inline void
 init_node (fence_kdump_node_t *node)
 {
-    node->info = NULL;
+    node->socket = -1;
+    node->state = FENCE_KDUMP_NODE_WAITING;
+    node->salen = 0;
 }
 
 static inline void
 free_node (fence_kdump_node_t *node)
 {
-    freeaddrinfo (node->info);
     free (node);
 }
 
@@ -93,7 +140,10 @@ print_node (const fence_kdump_node_t *node)
     fprintf (stdout, "[debug]:     name = %s\n", node->name);
     fprintf (stdout, "[debug]:     addr = %s\n", node->addr);
     fprintf (stdout, "[debug]:     port = %s\n", node->port);
-    fprintf (stdout, "[debug]:     info = %p\n", node->info);
+    fprintf (stdout, "[debug]:     sock = %d\n", node->socket);
+    /* fence_kdump resolves to ip, fence_kdump_send to sa */
+    fprintf (stdout, "[debug]:     fam  = %d\n",
+             (node->ip.family != AF_UNSPEC) ? node->ip.family : node->sa.ss_family);
     fprintf (stdout, "[debug]: }            \n");
 }
 
@@ -105,9 +155,24 @@ init_options (fence_kdump_opts_t *opts)
     opts->family   = FENCE_KDUMP_DEFAULT_FAMILY;
     opts->action   = FENCE_KDUMP_DEFAULT_ACTION;
     opts->count    = FENCE_KDUMP_DEFAULT_COUNT;
-    opts->interval = FENCE_KDUMP_DEFAULT_INTERVAL;
+    opts->interval = FENCE_KDUMP_DEFAULT_INTERVAL * 1000;
+    opts->burst_interval = 0;
+    opts->burst_duration = 0;
     opts->timeout  = FENCE_KDUMP_DEFAULT_TIMEOUT;
     opts->verbose  = FENCE_KDUMP_DEFAULT_VERBOSE;
+    opts->daemon   = 0;
+    opts->max_age  = FENCE_KDUMP_DEFAULT_MAX_AGE;
+    opts->socket   = strdup (FENCE_KDUMP_DEFAULT_SOCKET);
+    opts->hosts    = NULL;
+    opts->protocol = FENCE_KDUMP_DEFAULT_PROTOCOL;
+    opts->nodeid   = FENCE_KDUMP_DEFAULT_NODEID;
+    opts->keyfile  = NULL;
+    opts->progress = NULL;
+    opts->config   = NULL;
+    opts->stats    = FENCE_KDUMP_STATS_NONE;
+    opts->group    = NULL;
+    opts->interface = NULL;
+    opts->ttl      = FENCE_KDUMP_DEFAULT_TTL;
 
     INIT_LIST_HEAD (&opts->nodes);
 }
@@ -124,6 +189,13 @@ free_options (fence_kdump_opts_t *opts)
     }
 
     free (opts->nodename);
+    free (opts->socket);
+    free (opts->hosts);
+    free (opts->keyfile);
+    free (opts->progress);
+    free (opts->config);
+    free (opts->group);
+    free (opts->interface);
 }
 
 static inline void
@@ -136,9 +208,24 @@ print_options (fence_kdump_opts_t *opts)
     fprintf (stdout, "[debug]:     ipport   = %d\n", opts->ipport);
     fprintf (stdout, "[debug]:     family   = %d\n", opts->family);
     fprintf (stdout, "[debug]:     count    = %d\n", opts->count);
-    fprintf (stdout, "[debug]:     interval = %d\n", opts->interval);
+    fprintf (stdout, "[debug]:     interval = %d ms\n", opts->interval);
+    fprintf (stdout, "[debug]:     burst    = %d ms for %d ms\n",
+             opts->burst_interval, opts->burst_duration);
     fprintf (stdout, "[debug]:     timeout  = %d\n", opts->timeout);
     fprintf (stdout, "[debug]:     verbose  = %d\n", opts->verbose);
+    fprintf (stdout, "[debug]:     daemon   = %d\n", opts->daemon);
+    fprintf (stdout, "[debug]:     max_age  = %d\n", opts->max_age);
+    fprintf (stdout, "[debug]:     socket   = %s\n", opts->socket);
+    fprintf (stdout, "[debug]:     hosts    = %s\n", opts->hosts);
+    fprintf (stdout, "[debug]:     protocol = %d\n", opts->protocol);
+    fprintf (stdout, "[debug]:     nodeid   = %u\n", opts->nodeid);
+    fprintf (stdout, "[debug]:     keyfile  = %s\n", opts->keyfile);
+    fprintf (stdout, "[debug]:     progress = %s\n", opts->progress);
+    fprintf (stdout, "[debug]:     config   = %s\n", opts->config);
+    fprintf (stdout, "[debug]:     stats    = %d\n", opts->stats);
+    fprintf (stdout, "[debug]:     group    = %s\n", opts->group);
+    fprintf (stdout, "[debug]:     iface    = %s\n", opts->interface);
+    fprintf (stdout, "[debug]:     ttl      = %d\n", opts->ttl);
     fprintf (stdout, "[debug]: }                \n");
 
     list_for_each_entry (node, &opts->nodes, list) {
@@ -187,6 +274,10 @@ set_option_action (fence_kdump_opts_t *opts, const char *arg)
 {
     if (!strcasecmp (arg, "off")) {
         opts->action = FENCE_KDUMP_ACTION_OFF;
+    } else if (!strcasecmp (arg, "status")) {
+        opts->action = FENCE_KDUMP_ACTION_STATUS;
+    } else if (!strcasecmp (arg, "monitor")) {
+        opts->action = FENCE_KDUMP_ACTION_MONITOR;
     } else if (!strcasecmp (arg, "metadata")) {
         opts->action = FENCE_KDUMP_ACTION_METADATA;
     } else {
@@ -206,17 +297,66 @@ set_option_count (fence_kdump_opts_t *opts, const char *arg)
     }
 }
 
+/* parse "10", "2.5s" or "100ms" into milliseconds */
+static inline int
+parse_msec (const char *arg, const char **end)
+{
+    char *p;
+    double value;
+
+    value = strtod (arg, &p);
+
+    if (!strncasecmp (p, "ms", 2)) {
+        p += 2;
+    } else {
+        value *= 1000;
+        if ((*p == 's') || (*p == 'S')) {
+            p += 1;
+        }
+    }
+
+    if ((p == arg) || (value < 0) || (value > INT32_MAX)) {
+        return (-1);
+    }
+
+    *end = p;
+
+    return ((int) value);
+}
+
 static inline void
 set_option_interval (fence_kdump_opts_t *opts, const char *arg)
 {
-    opts->interval = atoi (arg);
+    const char *end;
+
+    opts->interval = parse_msec (arg, &end);
 
-    if (opts->interval < 1) {
+    if ((opts->interval < 1) || (*end != 0)) {
         fprintf (stderr, "[error]: invalid interval '%s'\n", arg);
         exit (1);
     }
 }
 
+static inline void
+set_option_burst (fence_kdump_opts_t *opts, const char *arg)
+{
+    const char *end;
+
+    opts->burst_interval = parse_msec (arg, &end);
+
+    if ((opts->burst_interval < 1) || (*end != ',')) {
+        fprintf (stderr, "[error]: invalid burst '%s'\n", arg);
+        exit (1);
+    }
+
+    opts->burst_duration = parse_msec (end + 1, &end);
+
+    if ((opts->burst_duration < 1) || (*end != 0)) {
+        fprintf (stderr, "[error]: invalid burst '%s'\n", arg);
+        exit (1);
+    }
+}
+
 static inline void
 set_option_timeout (fence_kdump_opts_t *opts, const char *arg)
 {
@@ -228,6 +368,138 @@ set_option_timeout (fence_kdump_opts_t *opts, const char *arg)
     }
 }
 
+static inline void
+set_option_max_age (fence_kdump_opts_t *opts, const char *arg)
+{
+    opts->max_age = atoi (arg);
+
+    if (opts->max_age < 1) {
+        fprintf (stderr, "[error]: invalid max-age '%s'\n", arg);
+        exit (1);
+    }
+}
+
+static inline void
+set_option_socket (fence_kdump_opts_t *opts, const char *arg)
+{
+    if (opts->socket != NULL) {
+        free (opts->socket);
+    }
+
+    opts->socket = strdup (arg);
+}
+
+static inline void
+set_option_hosts (fence_kdump_opts_t *opts, const char *arg)
+{
+    if (opts->hosts != NULL) {
+        free (opts->hosts);
+    }
+
+    opts->hosts = strdup (arg);
+}
+
+static inline void
+set_option_protocol (fence_kdump_opts_t *opts, const char *arg)
+{
+    /* the message version numbers, or 0 for both */
+    if (!strcasecmp (arg, "auto")) {
+        opts->protocol = 0;
+    } else if (!strcmp (arg, "1") || !strcmp (arg, "2")) {
+        opts->protocol = atoi (arg);
+    } else {
+        fprintf (stderr, "[error]: unsupported protocol '%s'\n", arg);
+        exit (1);
+    }
+}
+
+static inline void
+set_option_nodeid (fence_kdump_opts_t *opts, const char *arg)
+{
+    char *end;
+
+    opts->nodeid = strtoul (arg, &end, 0);
+
+    if ((*arg == 0) || (*end != 0)) {
+        fprintf (stderr, "[error]: invalid node id '%s'\n", arg);
+        exit (1);
+    }
+}
+
+static inline void
+set_option_keyfile (fence_kdump_opts_t *opts, const char *arg)
+{
+    if (opts->keyfile != NULL) {
+        free (opts->keyfile);
+    }
+
+    opts->keyfile = strdup (arg);
+}
+
+static inline void
+set_option_progress (fence_kdump_opts_t *opts, const char *arg)
+{
+    if (opts->progress != NULL) {
+        free (opts->progress);
+    }
+
+    opts->progress = strdup (arg);
+}
+
+static inline void
+set_option_stats (fence_kdump_opts_t *opts, const char *arg)
+{
+    if (!strcasecmp (arg, "none")) {
+        opts->stats = FENCE_KDUMP_STATS_NONE;
+    } else if (!strcasecmp (arg, "json")) {
+        opts->stats = FENCE_KDUMP_STATS_JSON;
+    } else {
+        fprintf (stderr, "[error]: unsupported stats format '%s'\n", arg);
+        exit (1);
+    }
+}
+
+static inline void
+set_option_config (fence_kdump_opts_t *opts, const char *arg)
+{
+    if (opts->config != NULL) {
+        free (opts->config);
+    }
+
+    opts->config = strdup (arg);
+}
+
+static inline void
+set_option_group (fence_kdump_opts_t *opts, const char *arg)
+{
+    if (opts->group != NULL) {
+        free (opts->group);
+    }
+
+    opts->group = strdup (arg);
+}
+
+static inline void
+set_option_interface (fence_kdump_opts_t *opts, const char *arg)
+{
+    if (opts->interface != NULL) {
+        free (opts->interface);
+    }
+
+    opts->interface = strdup (arg);
+}
+
+static inline void
+set_option_ttl (fence_kdump_opts_t *opts, const char *arg)
+{
+    opts->ttl = atoi (arg);
+
+    if ((opts->ttl < 1) || (opts->ttl > 255)) {
+        fprintf (stderr, "[error]: invalid multicast ttl '%s'\n", arg);
+        exit (1);
+    }
+}
+
 static inline void
 set_option_verbose (fence_kdump_opts_t *opts, const char *arg)
 {
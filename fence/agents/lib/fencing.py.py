@@ -1,6 +1,6 @@
 #!/usr/bin/python -tt
 
-import sys, getopt, time, os, uuid, pycurl, stat
+import sys, getopt, time, os, uuid, pycurl, stat, select, errno
 import pexpect, re, syslog
 import logging
 import subprocess
@@ -36,6 +36,21 @@ SSH_PATH = "/usr/bin/ssh"
 SSL_PATH = "@GNUTLSCLI_PATH@"
 SUDO_PATH = "/usr/bin/sudo"
 
+## ssh connections kept with --ssh-persist, one per user, host and port
+SSH_CONTROL_PATH = "@CLUSTERVARRUN@/fence_ssh_%r@%h:%p"
+
+## time observed between switching a device and its status following, see wait_power_status()
+SETTLE_PATH = "@CLUSTERVARRUN@/fence_settle"
+
+## power status polling starts at POWER_POLL_MIN seconds and doubles up to POWER_POLL_MAX,
+## the first poll comes at POWER_SETTLE_LEAD of the recorded settle time
+POWER_POLL_MIN = 0.05
+POWER_POLL_MAX = 1.0
+POWER_SETTLE_LEAD = 0.75
+
+## seconds a command which ran out of time gets between SIGTERM and SIGKILL
+RUN_COMMAND_GRACE = 2.0
+
 all_opt = {
 	"help"    : {
 		"getopt" : "h",
@@ -172,6 +187,14 @@ all_opt = {
 		"shortdesc" : "SSH options to use",
 		"required" : "0",
 		"order" : 1},
+	"ssh_persist" : {
+		"getopt" : ":",
+		"longopt" : "ssh-persist",
+		"help" : "--ssh-persist=[seconds]        Keep the ssh connection open for reuse (0 closes it)",
+		"shortdesc" : "Keep the ssh connection open for reuse for X seconds",
+		"default" : "0",
+		"required" : "0",
+		"order" : 1},
 	"ssl" : {
 		"getopt" : "z",
 		"longopt" : "ssl",
@@ -382,7 +405,7 @@ DEPENDENCY_OPT = {
 		"default" : ["help", "debug", "verbose", "version", "action", "agent", \
 			"power_timeout", "shell_timeout", "login_timeout", "power_wait", "retry_on", "delay"],
 		"passwd" : ["passwd_script"],
-		"secure" : ["identity_file", "ssh_options"],
+		"secure" : ["identity_file", "ssh_options", "ssh_persist"],
 		"ipaddr" : ["ipport", "inet4_only", "inet6_only"],
 		"port" : ["separator"],
 		"community" : ["snmp_auth_prot", "snmp_sec_level", "snmp_priv_prot", \
@@ -786,6 +809,67 @@ def check_input(device_opt, opt):
 
 	return options
 
+## Point options at one plug; uuid is filled in when the plug is one
+######
+def set_plug(options, plug):
+	try:
+		options["--uuid"] = str(uuid.UUID(plug))
+	except ValueError:
+		pass
+	except KeyError:
+		pass
+
+	options["--plug"] = plug
+	return options
+
+## Options of a plug which is handled in its own thread
+##	The copy is kept for the whole run, so values stored by the agent for
+##	a plug (e.g. a looked-up id) survive from the status query to the switch.
+######
+def plug_options(options, plug):
+	cache = options.setdefault("plug_options", {})
+	plug_opt = cache.setdefault(plug, {})
+	plug_opt.update([x for x in options.items() if x[0] != "plug_options"])
+	return set_plug(plug_opt, plug)
+
+## Run fn(conn, options) for every plug and return the results in plug order
+##	A connection without session state (None, or an object with a true
+##	'thread_safe' attribute such as FencingSnmp of an agent which opted in)
+##	lets every plug run in its own thread. The threads are released together, so the plugs of a
+##	redundant power supply switch at the same moment. A login session is
+##	shared and serves one plug after the other.
+######
+def run_on_plugs(conn, options, plugs, fn):
+	if len(plugs) < 2 or not (conn is None or getattr(conn, "thread_safe", False)):
+		return [fn(conn, set_plug(options, plug)) for plug in plugs]
+
+	gate = threading.Event()
+	results = [None] * len(plugs)
+	errors = [None] * len(plugs)
+
+	def run_plug(index, plug_opt):
+		gate.wait()
+		try:
+			results[index] = fn(conn, plug_opt)
+		except BaseException:
+			## fail() exits through SystemExit, which has to reach the main thread
+			errors[index] = sys.exc_info()
+
+	threads = [threading.Thread(target=run_plug, args=(index, plug_options(options, plug))) \
+			for (index, plug) in enumerate(plugs)]
+	for thread in threads:
+		thread.daemon = True
+		thread.start()
+	gate.set()
+	for thread in threads:
+		thread.join()
+
+	for error in errors:
+		if error is not None:
+			raise error[0], error[1], error[2]
+
+	return results
+
 ## Obtain a power status from possibly more than one plug
 ##	"on" is returned if at least one plug is ON
 ######
@@ -793,42 +877,92 @@ def get_multi_power_fn(tn, options, get_power_fn):
 	status = "off"
 	plugs = options["--plugs"] if options.has_key("--plugs") else [""]
 
-	for plug in plugs:
-		try:
-			options["--uuid"] = str(uuid.UUID(plug))
-		except ValueError:
-			pass
-		except KeyError:
-			pass
-
-		options["--plug"] = plug
-		plug_status = get_power_fn(tn, options)
+	for plug_status in run_on_plugs(tn, options, plugs, get_power_fn):
 		if plug_status != "off":
 			status = plug_status
 
 	return status
 
+## Seconds from an arbitrary point which do not follow changes of the system clock
+######
+def monotonic():
+	return os.times()[4]
+
+## Settle times are recorded per agent, device address and action
+######
+def settle_key(options):
+	return "%s:%s:%s" % (os.path.basename(sys.argv[0]), options.get("--ip", ""), options["--action"])
+
+def read_settle_times():
+	times = {}
+	try:
+		with open(SETTLE_PATH) as settle_file:
+			for line in settle_file:
+				(key, sep, value) = line.rstrip("\n").rpartition(" ")
+				if sep:
+					times[key] = float(value)
+	except (IOError, ValueError):
+		pass
+	return times
+
+def write_settle_time(key, settle):
+	times = read_settle_times()
+	times[key] = settle
+
+	## rename is atomic, concurrent agents can only lose each other's update
+	tmp_path = "%s.%d" % (SETTLE_PATH, os.getpid())
+	try:
+		with open(tmp_path, "w") as settle_file:
+			for (k, value) in times.items():
+				settle_file.write("%s %.3f\n" % (k, value))
+		os.rename(tmp_path, SETTLE_PATH)
+	except (IOError, OSError), ex:
+		logging.debug("Unable to record settle time: %s\n", str(ex))
+
+## Poll the power status until it follows options["--action"] or --power-timeout passes
+##	switched is the monotonic() time at which the plugs were switched, the
+##	--power-timeout counts from the call so that --power-wait does not eat into
+##	it. Polling starts shortly before the time the device needed last time and
+##	backs off exponentially, the time the status followed is recorded for the
+##	next run.
+######
+def wait_power_status(tn, options, get_power_fn, switched):
+	deadline = monotonic() + int(options["--power-timeout"])
+	key = settle_key(options)
+	settle = read_settle_times().get(key)
+	interval = POWER_POLL_MIN
+
+	if settle is not None:
+		remaining = min(switched + settle * POWER_SETTLE_LEAD, deadline) - monotonic()
+		if remaining > 0:
+			time.sleep(remaining)
+
+	while True:
+		polled = monotonic()
+		if get_multi_power_fn(tn, options, get_power_fn) == options["--action"]:
+			logging.debug("Status followed after %.3f second(s)\n", polled - switched)
+			write_settle_time(key, polled - switched)
+			return True
+
+		remaining = deadline - monotonic()
+		if remaining <= 0:
+			return False
+		time.sleep(min(interval, remaining))
+		interval = min(interval * 2, POWER_POLL_MAX)
+
+## Switch every plug before waiting, so that no plug of a redundant power
+## supply is left on while the others are already off
+######
 def set_multi_power_fn(tn, options, set_power_fn, get_power_fn, retry_attempts = 1):
 	plugs = options["--plugs"] if options.has_key("--plugs") else [""]
 
 	for _ in range(retry_attempts):
-		for plug in plugs:
-			try:
-				options["--uuid"] = str(uuid.UUID(plug))
-			except ValueError:
-				pass
-			except KeyError:
-				pass
+		run_on_plugs(tn, options, plugs, set_power_fn)
+		switched = monotonic()
+		time.sleep(int(options["--power-wait"]))
 
-			options["--plug"] = plug
-			set_power_fn(tn, options)
-			time.sleep(int(options["--power-wait"]))
-
-		for _ in xrange(int(options["--power-timeout"])):
-			if get_multi_power_fn(tn, options, get_power_fn) != options["--action"]:
-				time.sleep(1)
-			else:
-				return True
+		if wait_power_status(tn, options, get_power_fn, switched):
+			return True
 	return False
 
 def show_docs(options, docs=None):
@@ -966,6 +1100,9 @@ def fence_login(options, re_login_string=r"(login\s*: )|(Login Name:  )|(usernam
 	## Do the delay of the fence device before logging in
 	run_delay(options)
 
+	conn = None
+	mux_opts = ssh_mux_options(options)
+	mux_existed = mux_opts and os.path.exists(ssh_mux_path(options))
 	try:
 		re_login = re.compile(re_login_string, re.IGNORECASE)
 		re_pass = re.compile("(password)|(pass phrase)", re.IGNORECASE)
@@ -983,8 +1120,8 @@ def fence_login(options, re_login_string=r"(login\s*: )|(Login Name:  )|(usernam
 				logging.error("%s\n", str(ex))
 				sys.exit(EC_GENERIC_ERROR)
 		elif options.has_key("--ssh") and not options.has_key("--identity-file"):
-			command = '%s %s %s@%s -p %s -o PubkeyAuthentication=no' % \
-					(SSH_PATH, force_ipvx, options["--username"], options["--ip"], options["--ipport"])
+			command = '%s %s %s@%s -p %s -o PubkeyAuthentication=no%s' % \
+					(SSH_PATH, force_ipvx, options["--username"], options["--ip"], options["--ipport"], mux_opts)
 			if options.has_key("--ssh-options"):
 				command += ' ' + options["--ssh-options"]
 
@@ -1003,19 +1140,23 @@ def fence_login(options, re_login_string=r"(login\s*: )|(Login Name:  )|(usernam
 				conn.sendline(options["--username"])
 				conn.log_expect(options, re_pass, int(options["--login-timeout"]))
 			else:
+				## a session over a kept connection is not asked for the password
 				result = conn.log_expect(options, \
-						["ssword:", "Are you sure you want to continue connecting (yes/no)?"],
+						["ssword:", "Are you sure you want to continue connecting (yes/no)?"] + \
+						(mux_opts and options["--command-prompt"] or []),
 						int(options["--login-timeout"]))
 				if result == 1:
 					conn.sendline("yes")
 					conn.log_expect(options, "ssword:", int(options["--login-timeout"]))
+				elif result > 1:
+					return conn
 
 			conn.sendline(options["--password"])
 			conn.log_expect(options, options["--command-prompt"], int(options["--login-timeout"]))
 		elif options.has_key("--ssh") and options.has_key("--identity-file"):
-			command = '%s %s %s@%s -i %s -p %s' % \
+			command = '%s %s %s@%s -i %s -p %s%s' % \
 					(SSH_PATH, force_ipvx, options["--username"], options["--ip"], \
-					options["--identity-file"], options["--ipport"])
+					options["--identity-file"], options["--ipport"], mux_opts)
 			if options.has_key("--ssh-options"):
 				command += ' ' + options["--ssh-options"]
 
@@ -1070,12 +1211,74 @@ def fence_login(options, re_login_string=r"(login\s*: )|(Login Name:  )|(usernam
 					conn.log_expect(options, options["--command-prompt"], int(options["--login-timeout"]))
 			except KeyError:
 				fail(EC_PASSWORD_MISSING)
-	except pexpect.EOF:
-		fail(EC_LOGIN_DENIED)
-	except pexpect.TIMEOUT:
-		fail(EC_LOGIN_DENIED)
+	except (pexpect.EOF, pexpect.TIMEOUT):
+		if not (mux_existed and ssh_mux_failed(options, conn)):
+			fail(EC_LOGIN_DENIED)
+
+		## the delay has been served, log in again over a new connection
+		options["--delay"] = "0"
+		return fence_login(options, re_login_string)
 	return conn
 
+## ssh options which keep the connection open for --ssh-persist seconds after use
+##	Later runs against the same user, host and port attach to that connection
+##	instead of going through key exchange and authentication again. A control
+##	socket left by a dead connection is removed by ssh itself. The directory of
+##	the control sockets is on tmpfs, without it the connection is not kept.
+######
+def ssh_mux_options(options):
+	if not options.has_key("--ssh") or int(options.get("--ssh-persist", "0")) <= 0:
+		return ""
+
+	control_dir = os.path.dirname(SSH_CONTROL_PATH)
+	if not os.path.isdir(control_dir):
+		try:
+			os.makedirs(control_dir, 0700)
+		except OSError, ex:
+			logging.warning("Unable to create %s, not keeping the ssh connection: %s\n", \
+					control_dir, ex.strerror)
+			return ""
+
+	return " -o ControlMaster=auto -o ControlPath=%s -o ControlPersist=%d" \
+			" -o ServerAliveInterval=5 -o ServerAliveCountMax=3" % \
+			(SSH_CONTROL_PATH, int(options["--ssh-persist"]))
+
+## Control socket of the kept ssh connection, SSH_CONTROL_PATH as ssh expands it
+##	A host name mapped by ssh_config gives a different path, such a connection
+##	is then never taken for stale.
+######
+def ssh_mux_path(options):
+	return SSH_CONTROL_PATH.replace("%r", options["--username"]). \
+			replace("%h", options["--ip"]).replace("%p", options["--ipport"])
+
+## Stop the kept ssh connection a login failed over
+##	A master left wedged by a restart of the device answers ssh -O check until
+##	ServerAlive gives up on it, so it is stopped whenever a session over it did
+##	not reach the prompt. No password is asked over a kept connection, a wrong
+##	one cannot get here. Returns True when the login should be tried once more
+##	over a new connection.
+######
+def ssh_mux_failed(options, conn):
+	if options.has_key("ssh_mux_rebuilt"):
+		return False
+	options["ssh_mux_rebuilt"] = True
+
+	if conn is not None:
+		try:
+			conn.close(force=True)
+		except (exceptions.OSError, pexpect.ExceptionPexpect):
+			pass
+
+	logging.warning("Kept ssh connection to %s failed, opening a new one\n", options["--ip"])
+	command = '%s -o ControlPath=%s -O exit -p %s %s@%s' % \
+			(SSH_PATH, SSH_CONTROL_PATH, options["--ipport"], options["--username"], options["--ip"])
+	run_command(options, command, timeout=options["--login-timeout"])
+	try:
+		os.unlink(ssh_mux_path(options))
+	except OSError:
+		pass
+	return True
+
 def is_executable(path):
 	if os.path.exists(path):
 		stats = os.stat(path)
@@ -1083,6 +1286,11 @@ def is_executable(path):
 			return True
 	return False
 
+## Run a command and capture its output
+##	stdout and stderr are read as data arrives, so a command never blocks on a
+##	full pipe. When the timeout passes the command gets SIGTERM and, after
+##	RUN_COMMAND_GRACE seconds, SIGKILL.
+######
 def run_command(options, command, timeout=None, env=None):
 	if timeout is None and "--power-timeout" in options:
 		timeout = options["--power-timeout"]
@@ -1096,16 +1304,44 @@ def run_command(options, command, timeout=None, env=None):
 	except OSError:
 		fail_usage("Unable to run %s\n" % command)
 
-	thread = threading.Thread(target=process.wait)
-	thread.start()
-	thread.join(timeout)
-	if thread.is_alive():
-		process.kill()
-		fail(EC_TIMED_OUT)
+	deadline = None if timeout is None else monotonic() + timeout
+	output = {process.stdout.fileno() : [], process.stderr.fileno() : []}
+	poller = select.poll()
+	for fd in output.keys():
+		poller.register(fd, select.POLLIN)
+	open_pipes = len(output)
+
+	while open_pipes > 0 or process.poll() is None:
+		wait = None
+		if deadline is not None:
+			wait = deadline - monotonic()
+			if wait <= 0:
+				stop_command(process)
+				fail(EC_TIMED_OUT)
+
+		if open_pipes == 0:
+			## pipes are closed but the command still runs
+			time.sleep(min(0.01, wait) if wait is not None else 0.01)
+			continue
 
-	status = process.wait()
+		try:
+			events = poller.poll(None if wait is None else int(wait * 1000) + 1)
+		except select.error, ex:
+			if ex.args[0] == errno.EINTR:
+				continue
+			raise
+
+		for (fd, _) in events:
+			data = os.read(fd, 65536)
+			if data:
+				output[fd].append(data)
+			else:
+				poller.unregister(fd)
+				open_pipes -= 1
 
-	(pipe_stdout, pipe_stderr) = process.communicate()
+	status = process.returncode
+	pipe_stdout = "".join(output[process.stdout.fileno()])
+	pipe_stderr = "".join(output[process.stderr.fileno()])
 	process.stdout.close()
 	process.stderr.close()
 
@@ -1113,6 +1349,18 @@ def run_command(options, command, timeout=None, env=None):
 
 	return (status, pipe_stdout, pipe_stderr)
 
+def stop_command(process):
+	try:
+		process.terminate()
+		grace = monotonic() + RUN_COMMAND_GRACE
+		while process.poll() is None and monotonic() < grace:
+			time.sleep(0.01)
+		if process.poll() is None:
+			process.kill()
+			process.wait()
+	except OSError:
+		pass
+
 def run_delay(options):
 	## Delay is important for two-node clusters fencing but we do not need to delay 'status' operations
 	if options["--action"] in ["off", "reboot"]:
@@ -17,8 +17,11 @@ BUILD_DATE = ""
 #END_VERSION_GENERATION
 
 class FencingSnmp:
-	def __init__(self, options):
+	## every request runs its own snmp command, so an agent which keeps no state
+	## of a plug outside its options can have its plugs served in parallel
+	def __init__(self, options, thread_safe=False):
 		self.options = options
+		self.thread_safe = thread_safe
 		run_delay(options)
 
 	def quote_for_run(self, string):
@@ -38,6 +38,8 @@
 #include <string.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <netiucv/iucv.h>
 #include <arpa/inet.h>
@@ -48,13 +50,24 @@
 #include "fence_zvm.h"
 
 #define MIN(a,b)	((a) < (b) ? (a) : (b))
+#define MAX(a,b)	((a) > (b) ? (a) : (b))
 #define DEFAULT_TIMEOUT 300
 #define DEFAULT_DELAY   0
+#define MAX_EVENTS      16
 
-static int zvm_smapi_reportError(void *, void *);
+static int zvm_smapi_reportError(const char *, smapiOutHeader_t *);
+static int zvm_smapi_ready(zvm_driver_t *);
+static void zvm_set_deadline(zvm_driver_t *);
+static int zvm_remaining(zvm_driver_t *);
+static int zvm_smapi_wait(zvm_driver_t *, short);
+static int zvm_smapi_write(zvm_driver_t *, const void *, size_t);
+static int zvm_smapi_readSome(zvm_driver_t *, void *, size_t, size_t);
+static int zvm_smapi_read(zvm_driver_t *, void *, size_t);
+static int zvm_smapi_reserve(zvm_driver_t *, size_t);
 
 static struct option longopts[] = {
 	{"action",	required_argument,	NULL, 'o'},
+	{"concurrency",	required_argument,	NULL, 'c'},
 	{"delay",	required_argument,	NULL, 'h'},
 	{"help",	no_argument,		NULL, 'h'},
 	{"ip",		required_argument,	NULL, 'a'},
@@ -64,7 +77,7 @@ static struct option longopts[] = {
 	{NULL,		0,			NULL, 0}
 };
 
-static char *optString = "a:ho:n:T:";
+static char *optString = "a:c:ho:n:T:";
 
 static int zvm_metadata(void);
 static int usage(void);
@@ -79,10 +92,12 @@ int
 zvm_smapi_open(zvm_driver_t *zvm)
 {
 	int rc = -1,
-	sockaddrlen;
+	sockaddrlen,
+	ms;
 	static char iucvprog[9] = "DMSRSRQU\0";
 	struct sockaddr_iucv siucv_addr;
 	const struct sockaddr *siucv_ptr = (void *) &siucv_addr;
+	struct timeval tmo;
 
 	if ((zvm->sd = socket(AF_IUCV, SOCK_STREAM, IPPROTO_IP)) != -1) {
 		memset(&siucv_addr,0,sizeof(siucv_addr));
@@ -97,88 +112,258 @@ zvm_smapi_open(zvm_driver_t *zvm)
 			memcpy(&siucv_addr.siucv_user_id,zvm->smapiSrv,strlen(zvm->smapiSrv));
 			memcpy(&siucv_addr.siucv_name,&iucvprog,8);
 			memcpy(&siucv_addr.siucv_nodeid,zvm->node,strlen(zvm->node));
+			/*
+			 * AF_IUCV does not complete a non-blocking connect in the
+			 * background so bound the blocking one by the deadline
+			 */
+			ms = MAX(zvm_remaining(zvm), 1);
+			tmo.tv_sec  = ms / 1000;
+			tmo.tv_usec = (ms % 1000) * 1000;
+			(void) setsockopt(zvm->sd, SOL_SOCKET, SO_SNDTIMEO, &tmo, sizeof(tmo));
 			rc = connect(zvm->sd,(__CONST_SOCKADDR_ARG)siucv_ptr,sockaddrlen);
 		}
 		if (rc == -1) {
 			syslog(LOG_ERR, "Error connecting to %s - %m", zvm->smapiSrv);
 			close(zvm->sd);
+			zvm->sd = -1;
 		}
 	}
 	return(rc);
 }
 
 /**
- * zvm_smapi_imageRecycle
+ * zvm_smapi_putParm
+ * @p: Current position in the parameter list
+ * @parm: String parameter
+ *
+ * Append a length prefixed string to a parameter list
+ */
+static char *
+zvm_smapi_putParm(char *p, const char *parm)
+{
+	int32_t	lParm = strlen(parm);
+
+	memcpy(p, &lParm, sizeof(lParm));
+	memcpy(p + sizeof(lParm), parm, lParm);
+	return(p + sizeof(lParm) + lParm);
+}
+
+/**
+ * zvm_smapi_buildRequest
+ * @target: Name of the target image
+ * @fName: SMAPI function name
+ * @parm: Parameter following the target name, or NULL
+ * @lInPlist: Returned length of the parameter list
+ *
+ * Build the parameter list of a request for an image, freed by the caller
+ */
+static char *
+zvm_smapi_buildRequest(const char *target, const char *fName, const char *parm,
+		       int32_t *lInPlist)
+{
+	char	*inPlist,
+		*p;
+	int32_t	lPlist;
+
+	*lInPlist = 5 * sizeof(int32_t) + strlen(fName) + strlen(target);
+	if (parm != NULL)
+		*lInPlist += sizeof(int32_t) + strlen(parm);
+
+	inPlist = malloc(*lInPlist);
+	if (inPlist == NULL) {
+		syslog(LOG_ERR, "%s - cannot allocate parameter list", __func__);
+		return(NULL);
+	}
+
+	lPlist = *lInPlist - sizeof(lPlist);
+	memcpy(inPlist, &lPlist, sizeof(lPlist));
+	p = zvm_smapi_putParm(inPlist + sizeof(lPlist), fName);
+	/* the server knows the user from the IUCV connection */
+	p = zvm_smapi_putParm(p, "");
+	p = zvm_smapi_putParm(p, "");
+	p = zvm_smapi_putParm(p, target);
+	if (parm != NULL)
+		p = zvm_smapi_putParm(p, parm);
+	return(inPlist);
+}
+
+/**
+ * zvm_smapi_imageRequest
  * @zvm: z/VM driver information
+ * @fName: SMAPI function name
+ * @parm: Parameter following the target name, or NULL
+ * @rsp: Returned response, valid until the next request
  *
- * Deactivates a virtual image
+ * Send a request for the target image and receive its response
  */
-int
-zvm_smapi_imageRecycle(zvm_driver_t *zvm)
+static int
+zvm_smapi_imageRequest(zvm_driver_t *zvm, const char *fName, const char *parm,
+		       smapiOutHeader_t **rsp)
 {
-	struct _inPlist {
-		int32_t	lPlist;
-		int32_t	lFName;
-		char	fName[13];
-		int32_t lUser;
-		int32_t lPass;
-		int32_t	lTarget;
-		char	target[0];
-	} __attribute__ ((__packed__)) *inPlist;
-	int32_t	lInPlist;
-	struct	_outPlist {
-		smapiOutHeader_t hdr;
-		int32_t	nActive;
-		int32_t	nInActive;
-		int32_t	lFail;
-		char	failArray[0];
-	} *outPlist = NULL;
+	char	*inPlist;
+	int32_t	lInPlist,
+		lRsp;
 	void	*pOut = NULL;
-	int32_t	lRsp;
 	uint32_t reqId;
 	int	rc;
 
+	inPlist = zvm_smapi_buildRequest(zvm->target, fName, parm, &lInPlist);
+	if (inPlist == NULL)
+		return(-1);
+
 	/*
-	 * Implement any delay
-	 */ 
-	if (zvm->delay > 0) 
+	 * Connect before implementing any delay, so that the request
+	 * goes out the moment it ends and an unreachable server is
+	 * reported right away. The delay is kept either way, the
+	 * connection is retried after it.
+	 */
+	if (zvm->delay > 0) {
+		if (zvm_smapi_open(zvm) != 0)
+			syslog(LOG_WARNING, "Retrying connection to %s after delay",
+			       zvm->smapiSrv);
 		sleep(zvm->delay);
+		zvm->delay = 0;
+		zvm_set_deadline(zvm);
+	}
 
-	lInPlist = sizeof(*inPlist) + strlen(zvm->target);
-	inPlist = malloc(lInPlist);
-	if (inPlist != NULL) {
-		inPlist->lPlist = lInPlist - sizeof(inPlist->lPlist);
-		inPlist->lFName = sizeof(inPlist->fName);
-		memcpy(inPlist->fName, Image_Recycle, sizeof(inPlist->fName));
-		inPlist->lUser = inPlist->lPass = 0;
-		inPlist->lTarget = strlen(zvm->target);
-		memcpy(inPlist->target, zvm->target, inPlist->lTarget);
-		if ((rc = zvm_smapi_send(zvm, inPlist, &reqId, lInPlist)) != -1) {
-			if ((rc = zvm_smapi_recv(zvm, &pOut, &lRsp)) != -1) {
-				outPlist = pOut;
-				if (outPlist->hdr.rc == 0) {
-					syslog(LOG_INFO, "Recycling of %s successful",
-					       zvm->target);
-					rc = 0;
-				} else {
-					if ((outPlist->hdr.rc == RCERR_IMAGEOP) &
-					    ((outPlist->hdr.reason == RS_NOT_ACTIVE) |
-					     (outPlist->hdr.reason == RS_BEING_DEACT))) {
-						syslog(LOG_INFO, "Recycling of %s successful",
-						       zvm->target);
-						rc = 0;
-					} else {
-						rc = outPlist->hdr.rc;
-						zvm->reason = outPlist->hdr.reason;
-						(void) zvm_smapi_reportError(inPlist, outPlist);
-					}
-				}
-			}
+	if ((rc = zvm_smapi_send(zvm, inPlist, &reqId, lInPlist)) != -1) {
+		if ((rc = zvm_smapi_recv(zvm, &pOut, &lRsp)) != -1) {
+			*rsp = pOut;
+			rc = 0;
 		}
-		free(inPlist);
-		free(outPlist);
+	}
+	free(inPlist);
+	return(rc);
+}
+
+/**
+ * zvm_smapi_accepted
+ * @fName: SMAPI function name
+ * @out: Response header
+ *
+ * Check whether a response to an image operation means that it succeeded
+ */
+static int
+zvm_smapi_accepted(const char *fName, smapiOutHeader_t *out)
+{
+	if (out->rc == 0)
+		return(1);
+	if (out->rc != RCERR_IMAGEOP)
+		return(0);
+	if (strcmp(fName, Image_Activate) == 0)
+		return(out->reason == RS_ALREADY_ACTIVE);
+	return((out->reason == RS_NOT_ACTIVE) || (out->reason == RS_BEING_DEACT));
+}
+
+/**
+ * zvm_smapi_imageState
+ * @out: Response header of Image_Status_Query
+ *
+ * Map a status query response to ZVM_IMAGE_ACTIVE, ZVM_IMAGE_INACTIVE or -1
+ */
+static int
+zvm_smapi_imageState(smapiOutHeader_t *out)
+{
+	if ((out->rc == 0) && (out->reason == 0))
+		return(ZVM_IMAGE_ACTIVE);
+	if (((out->rc == 0) || (out->rc == RCERR_IMAGEOP)) &&
+	    (out->reason == RS_NOT_ACTIVE))
+		return(ZVM_IMAGE_INACTIVE);
+	return(-1);
+}
+
+/**
+ * zvm_smapi_imageRecycle
+ * @zvm: z/VM driver information
+ *
+ * Deactivates and reactivates a virtual image
+ */
+int
+zvm_smapi_imageRecycle(zvm_driver_t *zvm)
+{
+	smapiOutHeader_t *out = NULL;
+	int	rc;
+
+	if ((rc = zvm_smapi_imageRequest(zvm, Image_Recycle, NULL, &out)) == 0) {
+		if (zvm_smapi_accepted(Image_Recycle, out)) {
+			syslog(LOG_INFO, "Recycling of %s successful",
+			       zvm->target);
+		} else {
+			rc = out->rc;
+			zvm->reason = out->reason;
+			(void) zvm_smapi_reportError(Image_Recycle, out);
+		}
+	}
+	return(rc);
+}
+
+/**
+ * zvm_smapi_imageDeactivate
+ * @zvm: z/VM driver information
+ *
+ * Deactivates a virtual image immediately
+ */
+int
+zvm_smapi_imageDeactivate(zvm_driver_t *zvm)
+{
+	smapiOutHeader_t *out = NULL;
+	int	rc;
+
+	if ((rc = zvm_smapi_imageRequest(zvm, Image_Deactivate, FORCE_IMMED, &out)) == 0) {
+		if (zvm_smapi_accepted(Image_Deactivate, out)) {
+			syslog(LOG_INFO, "Deactivation of %s successful",
+			       zvm->target);
+		} else {
+			rc = out->rc;
+			zvm->reason = out->reason;
+			(void) zvm_smapi_reportError(Image_Deactivate, out);
+		}
+	}
+	return(rc);
+}
+
+/**
+ * zvm_smapi_imageActivate
+ * @zvm: z/VM driver information
+ *
+ * Activates a virtual image
+ */
+int
+zvm_smapi_imageActivate(zvm_driver_t *zvm)
+{
+	smapiOutHeader_t *out = NULL;
+	int	rc;
+
+	if ((rc = zvm_smapi_imageRequest(zvm, Image_Activate, NULL, &out)) == 0) {
+		if (zvm_smapi_accepted(Image_Activate, out)) {
+			syslog(LOG_INFO, "Activation of %s successful",
+			       zvm->target);
+		} else {
+			rc = out->rc;
+			zvm->reason = out->reason;
+			(void) zvm_smapi_reportError(Image_Activate, out);
+		}
+	}
+	return(rc);
+}
+
+/**
+ * zvm_smapi_imageActiveQuery
+ * @zvm: z/VM driver information
+ *
+ * Queries whether a virtual image is active. Returns ZVM_IMAGE_ACTIVE,
+ * ZVM_IMAGE_INACTIVE or -1 if the state could not be determined.
+ */
+int
+zvm_smapi_imageActiveQuery(zvm_driver_t *zvm)
+{
+	smapiOutHeader_t *out = NULL;
+	int	rc;
+
+	if ((rc = zvm_smapi_imageRequest(zvm, Image_Status_Query, NULL, &out)) == 0) {
+		if ((rc = zvm_smapi_imageState(out)) == -1)
+			(void) zvm_smapi_reportError(Image_Status_Query, out);
 	} else {
-		syslog(LOG_ERR, "%s - cannot allocate parameter list", __func__);
 		rc = -1;
 	}
 	return(rc);
@@ -196,31 +381,24 @@ zvm_smapi_imageRecycle(zvm_driver_t *zvm)
 int
 zvm_smapi_send(zvm_driver_t *zvm, void *req, uint32_t *reqId, int32_t lSend)
 {
-	int	rc,
-		nFds;
-	fd_set	readFds;
-	struct timeval timeout;
+	int	rc;
 
-	timeout.tv_sec = 30;
-	timeout.tv_usec = 0;
 	zvm->reason = -1;
-	if ((rc = zvm_smapi_open(zvm)) == 0) {
-		rc = send(zvm->sd,req,lSend,0);
-		if (rc != -1) {
-			FD_ZERO(&readFds);
-			FD_SET(zvm->sd,&readFds);
-			nFds = zvm->sd + 1; 
-
-			if ((rc = select(nFds,&readFds,NULL,NULL,&timeout)) != -1) {
-				/*
-				 * Get request ID
-				 */ 
-				rc = recv(zvm->sd,reqId,sizeof(*reqId),0);
-				if (rc == -1)
-					syslog(LOG_ERR, "Error receiving from SMAPI - %m");
-			}
+	if (zvm_smapi_ready(zvm))
+		rc = 0;
+	else
+		rc = zvm_smapi_open(zvm);
+	if (rc == 0) {
+		if ((rc = zvm_smapi_write(zvm, req, lSend)) != -1) {
+			/*
+			 * Get request ID
+			 */ 
+			if ((rc = zvm_smapi_read(zvm, reqId, sizeof(*reqId))) == -1)
+				syslog(LOG_ERR, "Error receiving from SMAPI - %m");
 		} else 
 			syslog(LOG_ERR, "Error sending to SMAPI - %m");
+		if (rc == -1)
+			(void) zvm_smapi_close(zvm);
 	}
 	return(rc);
 }
@@ -231,56 +409,85 @@ zvm_smapi_send(zvm_driver_t *zvm, void *req, uint32_t *reqId, int32_t lSend)
  * @req: Returned response parameter list
  * @lRsp: Length of response
  *
- * Receive a response from the SMAPI server
+ * Receive a response from the SMAPI server into the receive arena of the
+ * driver. The response stays valid until the next one is received.
  */
 int
 zvm_smapi_recv(zvm_driver_t *zvm, void **rsp, int32_t *lRsp)
 {
-	int	rc,
-		lRem = 0,
-		nFds;
-	void	*pRecv = rsp;
-	fd_set	readFds;
+	int	rc;
 	smapiOutHeader_t *out;
-	struct timeval timeout;
-
-	timeout.tv_sec = 30;
-	timeout.tv_usec = 0;
-	FD_ZERO(&readFds);
-	FD_SET(zvm->sd,&readFds);
-	nFds = zvm->sd + 1; 
+	size_t	lHave,
+		lWant;
 
 	zvm->reason = -1;
-	if ((rc = select(nFds,&readFds,NULL,NULL,&timeout)) != -1) {
-	/*
-	 * Get response length
-	 */ 
-	if ((rc = recv(zvm->sd,lRsp,sizeof(*lRsp),0)) != -1) {
-		lRem  = *lRsp;
-		if (*rsp == NULL) 
-			*rsp = malloc(*lRsp + sizeof(out->outLen));
-		out = *rsp;
-		out->outLen = *lRsp;
-		pRecv = &out->reqId;
-		while (lRem > 0) {
-			if ((rc = recv(zvm->sd,pRecv,lRem,0)) != -1) {
-				lRem -= rc;
-				pRecv = (void *) ((uintptr_t) pRecv + rc);
-			} else 
-				syslog(LOG_ERR, "Error receiving from SMAPI - %m");
-				(void) zvm_smapi_close(zvm);
-				return(rc);
+	*rsp = NULL;
+	if ((rc = zvm_smapi_reserve(zvm, ZVM_RSPBUF_MIN)) == 0) {
+		/*
+		 * Take the response length along with as much of the
+		 * response as there is room for
+		 */
+		if ((rc = zvm_smapi_readSome(zvm, zvm->rspBuf, sizeof(*lRsp),
+					     zvm->lRspBuf)) != -1) {
+			lHave = rc;
+			out = (smapiOutHeader_t *) zvm->rspBuf;
+			*lRsp = out->outLen;
+			lWant = *lRsp + sizeof(out->outLen);
+			if ((*lRsp < (int32_t) (sizeof(*out) - sizeof(out->outLen))) ||
+			    (*lRsp > ZVM_RSPBUF_MAX)) {
+				syslog(LOG_ERR, "Invalid response length of %d bytes from SMAPI", 
+				       *lRsp);
+				rc = -1;
+			} else if ((rc = zvm_smapi_reserve(zvm, lWant)) == 0) {
+				out = (smapiOutHeader_t *) zvm->rspBuf;
+				if ((lHave < lWant) &&
+				    (zvm_smapi_read(zvm, zvm->rspBuf + lHave, lWant - lHave) == -1)) {
+					syslog(LOG_ERR, "Error receiving from SMAPI - %m");
+					rc = -1;
+				} else {
+					if (lHave > lWant)
+						syslog(LOG_WARNING, "Ignoring %zu bytes after the SMAPI response", 
+						       lHave - lWant);
+					out->outLen = *lRsp;
+					zvm->reason = out->reason;
+					*rsp = out;
+				}
 			}
-			zvm->reason = out->reason;
-		}
-	} else 
-		syslog(LOG_ERR, "Error receiving from SMAPI - %m");
+		} else 
+			syslog(LOG_ERR, "Error receiving from SMAPI - %m");
+	}
 
 	(void) zvm_smapi_close(zvm);
 
 	return(rc);
 }
 
+/**
+ * zvm_smapi_reserve:
+ * @zvm: z/VM driver information
+ * @size: Number of bytes needed
+ *
+ * Grow the receive arena of the driver to hold at least size bytes
+ */
+static int
+zvm_smapi_reserve(zvm_driver_t *zvm, size_t size)
+{
+	size_t	lNew;
+	char	*buf;
+
+	if (size <= zvm->lRspBuf)
+		return(0);
+	for (lNew = MAX(zvm->lRspBuf, ZVM_RSPBUF_MIN); lNew < size; lNew *= 2)
+		;
+	if ((buf = realloc(zvm->rspBuf, lNew)) == NULL) {
+		syslog(LOG_ERR, "%s - cannot allocate response", __func__);
+		return(-1);
+	}
+	zvm->rspBuf = buf;
+	zvm->lRspBuf = lNew;
+	return(0);
+}
+
 /**
  * zvm_smapi_close:
  * @zvm: z/VM driver information
@@ -290,30 +497,192 @@ zvm_smapi_recv(zvm_driver_t *zvm, void **rsp, int32_t *lRsp)
 int
 zvm_smapi_close(zvm_driver_t *zvm)
 {
-	close(zvm->sd);
+	if (zvm->sd != -1) {
+		close(zvm->sd);
+		zvm->sd = -1;
+	}
+	return(0);
+}
+
+/**
+ * zvm_smapi_ready:
+ * @zvm: z/VM driver information
+ *
+ * Check that a connection opened ahead of a request is still usable
+ */
+static int
+zvm_smapi_ready(zvm_driver_t *zvm)
+{
+	struct pollfd pfd;
+
+	if (zvm->sd == -1)
+		return(0);
+
+	pfd.fd = zvm->sd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	/*
+	 * The server sends nothing before a request, so anything to
+	 * read means that it has dropped the connection
+	 */
+	if (poll(&pfd, 1, 0) != 0) {
+		(void) zvm_smapi_close(zvm);
+		return(0);
+	}
+	return(1);
+}
+
+/**
+ * zvm_set_deadline:
+ * @zvm: z/VM driver information
+ *
+ * Allow the operation to run for the timeout from now on
+ */
+static void
+zvm_set_deadline(zvm_driver_t *zvm)
+{
+	clock_gettime(CLOCK_MONOTONIC, &zvm->deadline);
+	zvm->deadline.tv_sec += zvm->timeOut;
+}
+
+/**
+ * zvm_remaining:
+ * @zvm: z/VM driver information
+ *
+ * Return the milliseconds left until the deadline of the operation
+ */
+static int
+zvm_remaining(zvm_driver_t *zvm)
+{
+	struct timespec now;
+	int64_t	ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (int64_t) (zvm->deadline.tv_sec - now.tv_sec) * 1000 +
+	     (zvm->deadline.tv_nsec - now.tv_nsec) / 1000000;
+	if (ms <= 0)
+		return(0);
+	return(MIN(ms, INT_MAX));
+}
+
+/**
+ * zvm_smapi_wait:
+ * @zvm: z/VM driver information
+ * @events: Events to wait for
+ *
+ * Wait for the connection to become ready, at most until the deadline
+ */
+static int
+zvm_smapi_wait(zvm_driver_t *zvm, short events)
+{
+	struct pollfd pfd;
+	int	rc;
+
+	pfd.fd = zvm->sd;
+	pfd.events = events;
+	do {
+		pfd.revents = 0;
+		rc = poll(&pfd, 1, zvm_remaining(zvm));
+	} while ((rc == -1) && (errno == EINTR));
+
+	if (rc == 0) {
+		errno = ETIMEDOUT;
+		return(-1);
+	}
+	return((rc == -1) ? -1 : 0);
+}
+
+/**
+ * zvm_smapi_write:
+ * @zvm: z/VM driver information
+ * @buf: Data to send
+ * @len: Length of data
+ *
+ * Send all of the data before the deadline
+ */
+static int
+zvm_smapi_write(zvm_driver_t *zvm, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t	n;
+
+	while (len > 0) {
+		n = send(zvm->sd, p, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n > 0) {
+			p += n;
+			len -= n;
+		} else if ((errno == EAGAIN) || (errno == EINTR)) {
+			if (zvm_smapi_wait(zvm, POLLOUT) == -1)
+				return(-1);
+		} else {
+			return(-1);
+		}
+	}
 	return(0);
 }
 
+/**
+ * zvm_smapi_readSome:
+ * @zvm: z/VM driver information
+ * @buf: Buffer for the data
+ * @lMin: Least number of bytes to receive
+ * @lMax: Room in the buffer
+ *
+ * Receive between lMin and lMax bytes before the deadline, returning the
+ * number of bytes received
+ */
+static int
+zvm_smapi_readSome(zvm_driver_t *zvm, void *buf, size_t lMin, size_t lMax)
+{
+	char	*p = buf;
+	size_t	lGot = 0;
+	ssize_t	n;
+
+	while (lGot < lMin) {
+		n = recv(zvm->sd, p + lGot, lMax - lGot, MSG_DONTWAIT);
+		if (n > 0) {
+			lGot += n;
+		} else if (n == 0) {
+			/*
+			 * The server closed the connection in the middle
+			 */
+			errno = ECONNRESET;
+			return(-1);
+		} else if ((errno == EAGAIN) || (errno == EINTR)) {
+			if (zvm_smapi_wait(zvm, POLLIN) == -1)
+				return(-1);
+		} else {
+			return(-1);
+		}
+	}
+	return(MIN(lGot, INT_MAX));
+}
+
+/**
+ * zvm_smapi_read:
+ * @zvm: z/VM driver information
+ * @buf: Buffer for the data
+ * @len: Length of data
+ *
+ * Receive exactly len bytes before the deadline
+ */
+static int
+zvm_smapi_read(zvm_driver_t *zvm, void *buf, size_t len)
+{
+	return((zvm_smapi_readSome(zvm, buf, len, len) == -1) ? -1 : 0);
+}
+
 /**
  * zvm_smapi_reportError
- * @inHdr - Input parameter list header
+ * @fName - SMAPI function name
  * @outHdr - Output parameter list header
  *
  * Report an error from the SMAPI server
  */
 static int
-zvm_smapi_reportError(void *inHdr, void *oHdr)
-{
-	struct _inParm {
-		int32_t	lPlist;
-		int32_t	lFName;
-		char	fName[0];
-	} *inParm = inHdr;
-	smapiOutHeader_t *outHdr = oHdr;
-	char	fName[64];
-
-	memset(fName, 0, sizeof(fName));
-	memcpy(fName, inParm->fName, inParm->lFName);
+zvm_smapi_reportError(const char *fName, smapiOutHeader_t *outHdr)
+{
 	syslog(LOG_ERR, "%s - returned (%d,%d)", 
 		fName, outHdr->rc, outHdr->reason);
 	return(-1);
@@ -403,6 +772,13 @@ zvm_metadata()
 	     "Time to delay fencing action in seconds");
 	fprintf (stdout, "\t</parameter>\n");
 
+	fprintf (stdout, "\t<parameter name=\"concurrency\" unique=\"1\" required=\"0\">\n");
+	fprintf (stdout, "\t\t<getopt mixed=\"-c, --concurrency\" />\n");
+	fprintf (stdout, "\t\t<content type=\"string\" default=\"8\" />\n");
+	fprintf (stdout, "\t\t<shortdesc lang=\"en\">%s</shortdesc>\n",
+	     "Connections open at once when fencing a list of targets");
+	fprintf (stdout, "\t</parameter>\n");
+
 	fprintf (stdout, "\t<parameter name=\"usage\" unique=\"1\" required=\"0\">\n");
 	fprintf (stdout, "\t\t<getopt mixed=\"-h, --help\" />\n");
 	fprintf (stdout, "\t\t<content type=\"boolean\" />\n");
@@ -413,7 +789,11 @@ zvm_metadata()
 	fprintf (stdout, "</parameters>\n");
 
 	fprintf (stdout, "<actions>\n");
+	fprintf (stdout, "\t<action name=\"on\" />\n");
 	fprintf (stdout, "\t<action name=\"off\" />\n");
+	fprintf (stdout, "\t<action name=\"reboot\" />\n");
+	fprintf (stdout, "\t<action name=\"status\" />\n");
+	fprintf (stdout, "\t<action name=\"monitor\" />\n");
 	fprintf (stdout, "\t<action name=\"metadata\" />\n");
 	fprintf (stdout, "</actions>\n");
 
@@ -423,6 +803,49 @@ zvm_metadata()
 
 }
 
+/**
+ * get_action - Map the name of an action to the action
+ * @action - Name of the action
+ *
+ */
+static int
+get_action(const char *action)
+{
+	if (strcasecmp(action, "off") == 0)
+		return(ZVM_ACTION_OFF);
+	if (strcasecmp(action, "on") == 0)
+		return(ZVM_ACTION_ON);
+	if (strcasecmp(action, "reboot") == 0)
+		return(ZVM_ACTION_REBOOT);
+	if (strcasecmp(action, "status") == 0)
+		return(ZVM_ACTION_STATUS);
+	if (strcasecmp(action, "monitor") == 0)
+		return(ZVM_ACTION_MONITOR);
+	if (strcasecmp(action, "metadata") == 0)
+		return(ZVM_ACTION_METADATA);
+	return(ZVM_ACTION_USAGE);
+}
+
+/**
+ * set_target - Remember the target or the list of targets
+ * @zvm - Pointer to driver information
+ * @arg - Name of the target, or names separated by commas
+ *
+ */
+static void
+set_target(zvm_driver_t *zvm, const char *arg)
+{
+	int32_t	lTarget;
+
+	if (strchr(arg, ',') != NULL) {
+		free(zvm->targets);
+		zvm->targets = strdup(arg);
+	} else {
+		lTarget = MIN(strlen(arg), sizeof(zvm->target)-1);
+		memcpy(zvm->target, arg, lTarget);
+	}
+}
+
 /**
  * get_options_stdin - get options from stdin
  * @zvm - Pointer to driver information
@@ -436,8 +859,7 @@ get_options_stdin (zvm_driver_t *zvm)
 		*opt,
 		*arg;
 	int32_t lSrvName,
-		lSrvNode,
-		lTarget;
+		lSrvNode;
 	int	fence = 0;
 
 	while (fgets (buf, sizeof (buf), stdin) != 0) {
@@ -461,20 +883,22 @@ get_options_stdin (zvm_driver_t *zvm)
 			continue;
 
 		if (!strcasecmp (opt, "action")) {
-			if (strcasecmp(arg, "off") == 0) {
-				fence = 0;
-			} else if (strcasecmp(arg, "metadata") == 0) {
-				fence = 1;
-			} else {
-				fence = 2;
-			}
+			fence = get_action(arg);
 		} else if (!strcasecmp (opt, "ipaddr")) {
 			lSrvName = MIN(strlen(arg), sizeof(zvm->smapiSrv));
 			memcpy(zvm->smapiSrv, arg, lSrvName);
 			continue;
 		} else if (!strcasecmp (opt, "port")) {
-			lTarget = MIN(strlen(arg), sizeof(zvm->target)-1);
-			strncpy(zvm->target, arg, lTarget);
+			set_target(zvm, arg);
+			continue;
+		} else if (!strcasecmp (opt, "concurrency")) {
+			zvm->concurrency = strtoul(arg, &endPtr, 10);
+			if ((*endPtr != 0) || (zvm->concurrency == 0)) {
+				syslog(LOG_WARNING, "Invalid concurrency value specified: %s - "
+				       "defaulting to %d", 
+				       arg, ZVM_DEFAULT_CONCURRENCY);
+				zvm->concurrency = ZVM_DEFAULT_CONCURRENCY;
+			}
 			continue;
 		} else if (!strcasecmp (opt, "timeout")) {
 			zvm->timeOut = strtoul(arg, &endPtr, 10);
@@ -516,25 +940,26 @@ get_options(int argc, char **argv, zvm_driver_t *zvm)
 	int	c,
 		fence = 0;
 	int32_t	lSrvName,
-		lSrvNode,
-		lTarget;
+		lSrvNode;
 	char	*endPtr;
 
 	while ((c = getopt_long(argc, argv, optString, longopts, NULL)) != -1) {
 		switch (c) {
 		case 'n' :
-			lTarget = MIN(strlen(optarg), sizeof(zvm->target));
-			memcpy(zvm->target, optarg, lTarget);
+			set_target(zvm, optarg);
 			break;
-		case 'o' :
-			if (strcasecmp(optarg, "off") == 0) {
-				fence = 0;
-			} else if (strcasecmp(optarg, "metadata") == 0) {
-				fence = 1;
-			} else {
-				fence = 2;
+		case 'c' :
+			zvm->concurrency = strtoul(optarg, &endPtr, 10);
+			if ((*endPtr != 0) || (zvm->concurrency == 0)) {
+				syslog(LOG_WARNING, "Invalid concurrency value specified: %s - "
+				       "defaulting to %d", 
+				       optarg, ZVM_DEFAULT_CONCURRENCY);
+				zvm->concurrency = ZVM_DEFAULT_CONCURRENCY;
 			}
 			break;
+		case 'o' :
+			fence = get_action(optarg);
+			break;
 		case 'a' :
 			lSrvName = MIN(strlen(optarg), sizeof(zvm->smapiSrv));
 			memcpy(zvm->smapiSrv, optarg, lSrvName);
@@ -577,11 +1002,13 @@ usage()
 {
 	fprintf(stderr,"Usage: fence_zvm [options]\n\n"
 		"\tWhere [options] =\n"
-		"\t-o --action [action]    - \"off\", \"metadata\"\n"
+		"\t-o --action [action]    - \"on\", \"off\", \"reboot\", \"status\",\n"
+		"\t                          \"monitor\", \"metadata\"\n"
 		"\t--delay [seconds]       - Time to delay fencing action in seconds\n"
-		"\t-n --plug [target]      - Name of virtual machine to fence\n"
+		"\t-n --plug [target]      - Name of virtual machine(s) to fence\n"
 		"\t-a --ip [server]        - Name of SMAPI IUCV Request server\n"
-		"\t-T --timeout [secs]     - Time to wait for fence in seconds - currently ignored\n"
+		"\t-T --timeout [secs]     - Time allowed for the action in seconds\n"
+		"\t-c --concurrency [n]    - Connections open at once for a list of targets\n"
 		"\t--zvmsys [node]         - z/VM Node on which SMAPI server lives\n"
 		"\t-h --help               - Display this usage information\n");
 	return(1);
@@ -598,7 +1025,7 @@ check_parm(zvm_driver_t *zvm)
 	int rc;
 
 	if (zvm->smapiSrv[0] != 0) {
-		if (zvm->target[0] != 0) {
+		if ((zvm->target[0] != 0) || (zvm->targets != NULL)) {
 			rc = 0;
 		} else {
 			syslog(LOG_ERR, "Missing fence target name");
@@ -611,6 +1038,535 @@ check_parm(zvm_driver_t *zvm)
 	return(rc);
 }
 
+/**
+ * zvm_wait_image - Query the target until it reaches a state
+ * @zvm - Pointer to driver information
+ * @state - ZVM_IMAGE_ACTIVE or ZVM_IMAGE_INACTIVE
+ *
+ */
+static int
+zvm_wait_image(zvm_driver_t *zvm, int state)
+{
+	int	rc;
+
+	for (;;) {
+		rc = zvm_smapi_imageActiveQuery(zvm);
+		if (rc == state)
+			return(0);
+		if (rc == -1)
+			return(1);
+		if (zvm_remaining(zvm) == 0) {
+			syslog(LOG_ERR, "Timed out waiting for %s to become %s",
+			       zvm->target,
+			       (state == ZVM_IMAGE_ACTIVE) ? "active" : "inactive");
+			return(1);
+		}
+		usleep(MIN(zvm_remaining(zvm), 1000) * 1000);
+	}
+}
+
+/**
+ * zvm_power_off - Deactivate the target and wait until it is down
+ * @zvm - Pointer to driver information
+ *
+ */
+static int
+zvm_power_off(zvm_driver_t *zvm)
+{
+	int	rc;
+
+	if ((rc = zvm_smapi_imageDeactivate(zvm)) == 0)
+		rc = zvm_wait_image(zvm, ZVM_IMAGE_INACTIVE);
+	return(rc);
+}
+
+/**
+ * zvm_power_on - Activate the target and wait until it is up
+ * @zvm - Pointer to driver information
+ *
+ */
+static int
+zvm_power_on(zvm_driver_t *zvm)
+{
+	int	rc;
+
+	if ((rc = zvm_smapi_imageActivate(zvm)) == 0)
+		rc = zvm_wait_image(zvm, ZVM_IMAGE_ACTIVE);
+	return(rc);
+}
+
+/**
+ * zvm_monitor - Check that the SMAPI server can be reached
+ * @zvm - Pointer to driver information
+ *
+ */
+static int
+zvm_monitor(zvm_driver_t *zvm)
+{
+	if (zvm->smapiSrv[0] == 0) {
+		syslog(LOG_ERR, "Missing SMAPI server name");
+		return(1);
+	}
+	if (zvm_smapi_open(zvm) != 0)
+		return(1);
+	(void) zvm_smapi_close(zvm);
+	return(0);
+}
+
+/**
+ * zvm_batch_finish - Record the result of a guest in a batch
+ * @guest - Guest information
+ * @result - Exit code for the guest
+ *
+ */
+static void
+zvm_batch_finish(zvm_guest_t *guest, int result)
+{
+	guest->state = ZVM_GUEST_DONE;
+	guest->result = result;
+	free(guest->req);
+	guest->req = NULL;
+}
+
+/**
+ * zvm_batch_close - Release the connection of a guest in a batch
+ * @epfd - epoll descriptor of the batch
+ * @guest - Guest information
+ *
+ */
+static void
+zvm_batch_close(int epfd, zvm_guest_t *guest)
+{
+	if (guest->sd != -1) {
+		(void) epoll_ctl(epfd, EPOLL_CTL_DEL, guest->sd, NULL);
+		close(guest->sd);
+		guest->sd = -1;
+	}
+}
+
+/**
+ * zvm_batch_connect - Open a connection to the SMAPI server for a batch
+ * @zvm - Pointer to driver information
+ *
+ * AF_IUCV connects synchronously, bounded by the deadline
+ */
+static int
+zvm_batch_connect(zvm_driver_t *zvm)
+{
+	int	sd;
+
+	if (zvm_smapi_open(zvm) != 0)
+		return(-1);
+	sd = zvm->sd;
+	zvm->sd = -1;
+	return(sd);
+}
+
+/**
+ * zvm_batch_start - Connect and queue the next request of a guest
+ * @zvm - Pointer to driver information
+ * @epfd - epoll descriptor of the batch
+ * @guest - Guest information
+ *
+ */
+static int
+zvm_batch_start(zvm_driver_t *zvm, int epfd, zvm_guest_t *guest)
+{
+	struct epoll_event ev;
+	const char *parm;
+
+	parm = (strcmp(guest->fName, Image_Deactivate) == 0) ? FORCE_IMMED : NULL;
+	free(guest->req);
+	guest->req = zvm_smapi_buildRequest(guest->target, guest->fName,
+					    parm, &guest->lReq);
+	if (guest->req == NULL)
+		return(-1);
+
+	if ((guest->sd = zvm_batch_connect(zvm)) == -1)
+		return(-1);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLOUT;
+	ev.data.ptr = guest;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, guest->sd, &ev) == -1) {
+		syslog(LOG_ERR, "Error watching connection for %s - %m",
+		       guest->target);
+		zvm_batch_close(epfd, guest);
+		return(-1);
+	}
+	guest->state = ZVM_GUEST_SEND;
+	guest->lXfer = 0;
+	return(0);
+}
+
+/**
+ * zvm_batch_io - Move the request of a guest along
+ * @epfd - epoll descriptor of the batch
+ * @guest - Guest information
+ *
+ * Returns 1 once the whole response is in, 0 while more is to come
+ * and -1 on failure
+ */
+static int
+zvm_batch_io(int epfd, zvm_guest_t *guest)
+{
+	struct epoll_event ev;
+	char	discard[256],
+		*buf;
+	ssize_t	n;
+	int32_t	lBuf;
+
+	if (guest->state == ZVM_GUEST_SEND) {
+		while (guest->lXfer < guest->lReq) {
+			n = send(guest->sd, guest->req + guest->lXfer,
+				 guest->lReq - guest->lXfer,
+				 MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (n == -1) {
+				if ((errno == EAGAIN) || (errno == EINTR))
+					return(0);
+				syslog(LOG_ERR, "Error sending to SMAPI for %s - %m",
+				       guest->target);
+				return(-1);
+			}
+			guest->lXfer += n;
+		}
+
+		/*
+		 * The request id and the response length come first
+		 */
+		guest->state = ZVM_GUEST_RECV;
+		guest->lXfer = 0;
+		guest->lRsp = 2 * sizeof(uint32_t);
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = guest;
+		if (epoll_ctl(epfd, EPOLL_CTL_MOD, guest->sd, &ev) == -1)
+			return(-1);
+		return(0);
+	}
+
+	while (guest->lXfer < guest->lRsp) {
+		if (guest->lXfer < (int32_t) sizeof(guest->rsp)) {
+			buf = (char *) &guest->rsp + guest->lXfer;
+			lBuf = MIN(guest->lRsp, (int32_t) sizeof(guest->rsp)) - guest->lXfer;
+		} else {
+			/*
+			 * Only the header is of interest
+			 */
+			buf = discard;
+			lBuf = MIN(guest->lRsp - guest->lXfer, (int32_t) sizeof(discard));
+		}
+		n = recv(guest->sd, buf, lBuf, MSG_DONTWAIT);
+		if (n == 0) {
+			syslog(LOG_ERR, "SMAPI closed the connection for %s",
+			       guest->target);
+			return(-1);
+		}
+		if (n == -1) {
+			if ((errno == EAGAIN) || (errno == EINTR))
+				return(0);
+			syslog(LOG_ERR, "Error receiving from SMAPI for %s - %m",
+			       guest->target);
+			return(-1);
+		}
+		guest->lXfer += n;
+		if ((guest->lXfer == 2 * sizeof(uint32_t)) &&
+		    (guest->lRsp == 2 * sizeof(uint32_t))) {
+			if ((guest->rsp.out.outLen < sizeof(guest->rsp.out) -
+						     sizeof(guest->rsp.out.outLen)) ||
+			    (guest->rsp.out.outLen > ZVM_RSPBUF_MAX)) {
+				syslog(LOG_ERR, "Invalid response length of %u bytes from SMAPI for %s",
+				       guest->rsp.out.outLen, guest->target);
+				return(-1);
+			}
+			guest->lRsp += guest->rsp.out.outLen;
+		}
+	}
+
+	/*
+	 * Never judge a guest by a return and reason code not received
+	 */
+	if (guest->lXfer < (int32_t) sizeof(guest->rsp)) {
+		syslog(LOG_ERR, "Incomplete response header from SMAPI for %s",
+		       guest->target);
+		return(-1);
+	}
+	return(1);
+}
+
+/**
+ * zvm_batch_next - Decide what follows a response for a guest
+ * @fence - Action being performed
+ * @guest - Guest information
+ *
+ */
+static void
+zvm_batch_next(int fence, zvm_guest_t *guest)
+{
+	smapiOutHeader_t *out = &guest->rsp.out;
+	int	state;
+
+	if (strcmp(guest->fName, Image_Status_Query) != 0) {
+		if (!zvm_smapi_accepted(guest->fName, out)) {
+			(void) zvm_smapi_reportError(guest->fName, out);
+			zvm_batch_finish(guest, 1);
+		} else if (fence == ZVM_ACTION_REBOOT) {
+			syslog(LOG_INFO, "Recycling of %s successful", guest->target);
+			zvm_batch_finish(guest, 0);
+		} else {
+			/*
+			 * Wait for the image to reach its new state
+			 */
+			guest->fName = Image_Status_Query;
+			guest->state = ZVM_GUEST_READY;
+			clock_gettime(CLOCK_MONOTONIC, &guest->next);
+		}
+		return;
+	}
+
+	if ((state = zvm_smapi_imageState(out)) == -1) {
+		(void) zvm_smapi_reportError(guest->fName, out);
+		zvm_batch_finish(guest, 1);
+	} else if (fence == ZVM_ACTION_STATUS) {
+		zvm_batch_finish(guest, state);
+	} else if (state == ((fence == ZVM_ACTION_ON) ? ZVM_IMAGE_ACTIVE
+						     : ZVM_IMAGE_INACTIVE)) {
+		syslog(LOG_INFO, "%s of %s successful",
+		       (fence == ZVM_ACTION_ON) ? "Activation" : "Deactivation",
+		       guest->target);
+		zvm_batch_finish(guest, 0);
+	} else {
+		/*
+		 * Query again in a second
+		 */
+		guest->state = ZVM_GUEST_READY;
+		clock_gettime(CLOCK_MONOTONIC, &guest->next);
+		guest->next.tv_sec++;
+	}
+}
+
+/**
+ * zvm_batch_report - Show the result of each guest in a batch
+ * @fence - Action performed
+ * @guests - Guests of the batch
+ * @nGuests - Number of guests
+ *
+ * Returns 1 if any guest failed; for status 2 if any guest is inactive
+ */
+static int
+zvm_batch_report(int fence, zvm_guest_t *guests, int nGuests)
+{
+	int	i,
+		rc = 0;
+
+	for (i = 0; i < nGuests; i++) {
+		if (guests[i].result == 1) {
+			fprintf(stdout, "%s: failed\n", guests[i].target);
+			rc = 1;
+		} else if (fence == ZVM_ACTION_STATUS) {
+			fprintf(stdout, "%s: %s\n", guests[i].target,
+				(guests[i].result == ZVM_IMAGE_ACTIVE) ? "on" : "off");
+			if ((rc == 0) && (guests[i].result == ZVM_IMAGE_INACTIVE))
+				rc = ZVM_IMAGE_INACTIVE;
+		} else {
+			fprintf(stdout, "%s: success\n", guests[i].target);
+		}
+	}
+	return(rc);
+}
+
+/**
+ * zvm_batch_parse - Split the list of targets
+ * @zvm - Pointer to driver information
+ * @nGuests - Returned number of guests
+ *
+ */
+static zvm_guest_t *
+zvm_batch_parse(zvm_driver_t *zvm, int *nGuests)
+{
+	zvm_guest_t *guests;
+	char	*list,
+		*name,
+		*save;
+	int	n = 1;
+
+	for (name = zvm->targets; *name != 0; name++) {
+		if (*name == ',')
+			n++;
+	}
+	if ((guests = calloc(n, sizeof(*guests))) == NULL ||
+	    (list = strdup(zvm->targets)) == NULL) {
+		syslog(LOG_ERR, "%s - cannot allocate guest list", __func__);
+		free(guests);
+		return(NULL);
+	}
+
+	n = 0;
+	for (name = strtok_r(list, ", \t", &save); name != NULL;
+	     name = strtok_r(NULL, ", \t", &save)) {
+		if (strlen(name) >= sizeof(guests[n].target))
+			syslog(LOG_WARNING, "Target name %s truncated", name);
+		strncpy(guests[n].target, name, sizeof(guests[n].target) - 1);
+		guests[n].sd = -1;
+		n++;
+	}
+	free(list);
+	*nGuests = n;
+	return(guests);
+}
+
+/**
+ * zvm_batch - Perform an action on a list of targets
+ * @zvm - Pointer to driver information
+ * @fence - Action to perform
+ *
+ * The requests of all targets run concurrently over at most
+ * zvm->concurrency connections and the whole batch is bounded
+ * by the timeout.
+ */
+static int
+zvm_batch(zvm_driver_t *zvm, int fence)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct timespec now;
+	zvm_guest_t *guests,
+		*guest;
+	int	epfd,
+		nGuests,
+		pending,
+		active = 0,
+		wait,
+		due,
+		n,
+		i,
+		rc;
+
+	if ((guests = zvm_batch_parse(zvm, &nGuests)) == NULL)
+		return(1);
+	if (nGuests == 0) {
+		syslog(LOG_ERR, "Missing fence target name");
+		free(guests);
+		return(2);
+	}
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		syslog(LOG_ERR, "Error creating epoll descriptor - %m");
+		free(guests);
+		return(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < nGuests; i++) {
+		switch (fence) {
+			case ZVM_ACTION_OFF :
+				guests[i].fName = Image_Deactivate;
+				break;
+			case ZVM_ACTION_ON :
+				guests[i].fName = Image_Activate;
+				break;
+			case ZVM_ACTION_REBOOT :
+				guests[i].fName = Image_Recycle;
+				break;
+			default :
+				guests[i].fName = Image_Status_Query;
+		}
+		guests[i].next = now;
+	}
+
+	/*
+	 * As for a single guest, connect before implementing any delay,
+	 * so that the first requests go out the moment it ends and an
+	 * unreachable server is reported right away. The delay is kept
+	 * either way, the guests not connected yet are started after it.
+	 */
+	if (zvm->delay > 0) {
+		for (i = 0; (i < nGuests) && (active < (int) zvm->concurrency); i++) {
+			if (zvm_batch_start(zvm, epfd, &guests[i]) != 0) {
+				syslog(LOG_WARNING, "Retrying connection to %s after delay",
+				       zvm->smapiSrv);
+				break;
+			}
+			active++;
+		}
+		sleep(zvm->delay);
+		zvm->delay = 0;
+		zvm_set_deadline(zvm);
+	}
+
+	pending = nGuests;
+	while (pending > 0) {
+		if ((wait = zvm_remaining(zvm)) == 0) {
+			for (i = 0; i < nGuests; i++) {
+				if (guests[i].state != ZVM_GUEST_DONE) {
+					syslog(LOG_ERR, "Timed out fencing %s",
+					       guests[i].target);
+					zvm_batch_close(epfd, &guests[i]);
+					zvm_batch_finish(&guests[i], 1);
+				}
+			}
+			break;
+		}
+
+		/*
+		 * Start the requests that are due while connections are free,
+		 * and sleep no longer than until the next one falls due
+		 */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (i = 0; i < nGuests; i++) {
+			guest = &guests[i];
+			if (guest->state != ZVM_GUEST_READY)
+				continue;
+			due = (guest->next.tv_sec - now.tv_sec) * 1000 +
+			      (guest->next.tv_nsec - now.tv_nsec) / 1000000;
+			if (due > 0) {
+				wait = MIN(wait, due);
+			} else if (active < (int) zvm->concurrency) {
+				if (zvm_batch_start(zvm, epfd, guest) == 0) {
+					active++;
+				} else {
+					zvm_batch_finish(guest, 1);
+					pending--;
+				}
+			}
+		}
+		if (pending == 0)
+			break;
+
+		n = epoll_wait(epfd, events, MAX_EVENTS, wait);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "Error waiting for SMAPI - %m");
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			guest = events[i].data.ptr;
+			if ((rc = zvm_batch_io(epfd, guest)) == 0)
+				continue;
+			zvm_batch_close(epfd, guest);
+			active--;
+			if (rc == 1)
+				zvm_batch_next(fence, guest);
+			else
+				zvm_batch_finish(guest, 1);
+			if (guest->state == ZVM_GUEST_DONE)
+				pending--;
+		}
+	}
+
+	for (i = 0; i < nGuests; i++) {
+		if (guests[i].state != ZVM_GUEST_DONE) {
+			zvm_batch_close(epfd, &guests[i]);
+			zvm_batch_finish(&guests[i], 1);
+		}
+	}
+	close(epfd);
+
+	rc = zvm_batch_report(fence, guests, nGuests);
+	free(guests);
+	return(rc);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -620,25 +1576,64 @@ main(int argc, char **argv)
 
 	openlog ("fence_zvm", LOG_CONS|LOG_PID, LOG_DAEMON);
 	memset(&zvm, 0, sizeof(zvm));
+	zvm.sd      = -1;
 	zvm.timeOut = DEFAULT_TIMEOUT;
 	zvm.delay   = DEFAULT_DELAY;
+	zvm.concurrency = ZVM_DEFAULT_CONCURRENCY;
 
 	if (argc > 1)
 		fence = get_options(argc, argv, &zvm);
 	else
 		fence = get_options_stdin(&zvm);
 
+	/*
+	 * Only the actions that fence implement the delay
+	 */
+	if ((fence != ZVM_ACTION_OFF) && (fence != ZVM_ACTION_REBOOT))
+		zvm.delay = 0;
+
+	zvm_set_deadline(&zvm);
+
 	switch(fence) {
-		case 0 :
+		case ZVM_ACTION_OFF :
 			if ((rc = check_parm(&zvm)) == 0)
-				rc = zvm_smapi_imageRecycle(&zvm);
+				rc = (zvm.targets != NULL) ? zvm_batch(&zvm, fence)
+							   : zvm_power_off(&zvm);
+			if (rc != 0)
+				rc = 1;
 			break;
-		case 1 :
+		case ZVM_ACTION_ON :
+			if ((rc = check_parm(&zvm)) == 0)
+				rc = (zvm.targets != NULL) ? zvm_batch(&zvm, fence)
+							   : zvm_power_on(&zvm);
+			if (rc != 0)
+				rc = 1;
+			break;
+		case ZVM_ACTION_REBOOT :
+			if ((rc = check_parm(&zvm)) == 0)
+				rc = (zvm.targets != NULL) ? zvm_batch(&zvm, fence)
+							   : zvm_smapi_imageRecycle(&zvm);
+			if (rc != 0)
+				rc = 1;
+			break;
+		case ZVM_ACTION_STATUS :
+			if ((rc = check_parm(&zvm)) == 0)
+				rc = (zvm.targets != NULL) ? zvm_batch(&zvm, fence)
+							   : zvm_smapi_imageActiveQuery(&zvm);
+			if ((rc != ZVM_IMAGE_ACTIVE) && (rc != ZVM_IMAGE_INACTIVE))
+				rc = 1;
+			break;
+		case ZVM_ACTION_MONITOR :
+			rc = zvm_monitor(&zvm);
+			break;
+		case ZVM_ACTION_METADATA :
 			rc = zvm_metadata();
 			break;
-		case 2 :
+		case ZVM_ACTION_USAGE :
 			rc = usage();
 	}
+	free(zvm.targets);
+	free(zvm.rspBuf);
 	closelog();
 	return (rc);
 }
@@ -650,6 +1645,6 @@ main(int argc, char **argv)
 	openlog ("fence_zvm", LOG_CONS|LOG_PID, LOG_DAEMON);
 	syslog(LOG_ERR,"Fencing of a z/VM agent is not possible on this platform\n");
 	closelog();
-	return(-1);
+	return(1);
 }
 #endif
@@ -26,6 +26,7 @@
 # define FENCE_ZVM_H
 
 # include <sys/types.h>
+# include <sys/socket.h>
 
 # define SMAPI_TARGET	"OVIRTADM"
 # define SMAPI_MAXCPU   96
@@ -558,16 +559,82 @@ typedef struct {
 	uint8_t	devAddr[4];
 } __attribute__ ((__packed__)) zvm_actImgDev_t;
 
+/*
+ * Image states returned by zvm_smapi_imageActiveQuery, the same as
+ * the exit codes of the status action
+ */
+# define ZVM_IMAGE_ACTIVE	0
+# define ZVM_IMAGE_INACTIVE	2
+
+/*
+ * Actions of the agents
+ */
+# define ZVM_ACTION_OFF		0
+# define ZVM_ACTION_METADATA	1
+# define ZVM_ACTION_USAGE	2
+# define ZVM_ACTION_ON		3
+# define ZVM_ACTION_REBOOT	4
+# define ZVM_ACTION_STATUS	5
+# define ZVM_ACTION_MONITOR	6
+
+/*
+ * States of a guest fenced as part of a batch
+ */
+# define ZVM_GUEST_READY	0	/* Waiting to send its next request */
+# define ZVM_GUEST_SEND		1	/* Connecting and sending the request */
+# define ZVM_GUEST_RECV		2	/* Receiving the response */
+# define ZVM_GUEST_DONE		3	/* Result is known */
+
+# define ZVM_DEFAULT_CONCURRENCY	8
+
+/*
+ * Initial and largest size of the receive arena
+ */
+# define ZVM_RSPBUF_MIN		1024
+# define ZVM_RSPBUF_MAX		(16 * 1024 * 1024)
+
+/*
+ * Connecting to the SMAPI server over TCP/IP
+ */
+# define ZVM_DEFAULT_PORT	"44444"
+# define ZVM_MAX_ADDRS		16	/* Addresses tried for all servers */
+# define ZVM_CONNECT_STAGGER	250	/* Head start of each attempt in ms */
+
+typedef struct {
+	char	 target[9];
+	int	 sd;
+	int	 state;			/* ZVM_GUEST_xxx */
+	int	 result;		/* Exit code for this guest */
+	const char *fName;		/* SMAPI function in progress */
+	char	*req;			/* Its parameter list */
+	int32_t	 lReq;
+	int32_t	 lXfer;			/* Bytes sent or received so far */
+	int32_t	 lRsp;			/* Bytes of response expected */
+	struct {
+		uint32_t reqId;
+		smapiOutHeader_t out;
+	} rsp;				/* Request id and response header */
+	struct timespec next;		/* Earliest time of the next request */
+} zvm_guest_t;
+
 typedef struct {
 	int	 sd;
 	int	 reason;
 	uint32_t timeOut;
 	uint32_t delay;
+	uint32_t concurrency;		/* Connections open at once in a batch */
+	struct timespec deadline;	/* End of the current operation */
+	char	*targets;		/* Comma separated list of targets */
+	char	*rspBuf;		/* Receive arena reused by each response */
+	size_t	 lRspBuf;
 	char	 target[9];
 	char	 authUser[9];
 	char	 authPass[9];
 	char	 node[9];
-	char	 smapiSrv[128];
+	char	 smapiSrv[128];		/* fence_zvmip takes a list of servers */
+	char	 smapiPort[32];
+	struct sockaddr_storage smapiAddr; /* Address last connected to */
+	socklen_t lSmapiAddr;
 } zvm_driver_t;
 
 int zvm_smapi_open(zvm_driver_t *);
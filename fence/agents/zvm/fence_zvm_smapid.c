@@ -0,0 +1,663 @@
+/*
+ * fence_zvm_smapid.c: SMAPI stand-in server for testing the z/VM agents
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Speaks the SMAPI framing of fence_zvmip over TCP/IP on any Linux box:
+ * a request is a length prefixed parameter list in the byte order of the
+ * agent, answered by a request id and then by a length prefixed
+ * smapiOutHeader_t in network byte order, after which the connection is
+ * closed. Each guest is active until it is deactivated, which takes
+ * effect after a configurable time. The request id and the response can
+ * be delayed, written in small pieces, padded, and the result of any
+ * function can be scripted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include "fence_zvm.h"
+
+#define MIN(a,b)	((a) < (b) ? (a) : (b))
+#define MAX(a,b)	((a) > (b) ? (a) : (b))
+#define DEFAULT_ADDR	"127.0.0.1"
+#define MAX_CONNS	1024
+#define MAX_SCRIPTS	32
+#define MAX_REQUEST	4096
+#define GUEST_BUCKETS	4096
+
+typedef struct guest {
+	struct guest *next;
+	char	 name[9];
+	int	 active;
+	int64_t	 inactiveAt;		/* When a deactivation completes, or 0 */
+} guest_t;
+
+typedef struct {
+	char	 target[9];		/* Empty for any target */
+	char	 fName[64];
+	uint32_t rc;
+	uint32_t reason;
+} script_t;
+
+typedef struct {
+	int	 sd;
+	int32_t	 lIn;			/* Bytes of the request received */
+	char	 in[MAX_REQUEST];
+	char	*out;			/* Request id and response */
+	int32_t	 lOut,
+		 offOut,		/* Bytes written so far */
+		 markOut;		/* Bytes that may be written now */
+	int64_t	 due;			/* When writing may go on, or 0 */
+} conn_t;
+
+typedef struct {
+	const char *addr;
+	const char *port;
+	int	 idDelay;		/* ms before the request id */
+	int	 rspDelay;		/* ms before the response */
+	int	 deactTime;		/* ms a deactivation takes */
+	int	 chunk;			/* Bytes per write, 0 for all at once */
+	int	 chunkWait;		/* ms between writes */
+	int	 pad;			/* Bytes appended to each response */
+	int	 verbose;
+	int	 nScripts;
+	script_t scripts[MAX_SCRIPTS];
+} smapid_t;
+
+static guest_t *guests[GUEST_BUCKETS];
+static conn_t *conns[MAX_CONNS];
+static uint32_t reqIds;
+static volatile sig_atomic_t stop;
+
+static struct option longopts[] = {
+	{"address",	required_argument,	NULL, 'a'},
+	{"port",	required_argument,	NULL, 'p'},
+	{"id-delay",	required_argument,	NULL, 'i'},
+	{"delay",	required_argument,	NULL, 'd'},
+	{"deactivate",	required_argument,	NULL, 'x'},
+	{"chunk",	required_argument,	NULL, 'c'},
+	{"chunk-wait",	required_argument,	NULL, 'w'},
+	{"pad",		required_argument,	NULL, 'P'},
+	{"result",	required_argument,	NULL, 'r'},
+	{"verbose",	no_argument,		NULL, 'v'},
+	{"help",	no_argument,		NULL, 'h'},
+	{NULL,		0,			NULL, 0}
+};
+
+static const char *optString = "a:p:i:d:x:c:w:P:r:vh";
+
+/**
+ * now_ms - Milliseconds on the monotonic clock
+ *
+ */
+static int64_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/**
+ * get_guest - Find a guest, creating it active when first seen
+ * @name - Name of the guest
+ *
+ */
+static guest_t *
+get_guest(const char *name)
+{
+	guest_t	*g;
+	uint32_t h = 5381;
+	const char *p;
+
+	for (p = name; *p != 0; p++)
+		h = h * 33 + (unsigned char) *p;
+	h %= GUEST_BUCKETS;
+
+	for (g = guests[h]; g != NULL; g = g->next) {
+		if (strcmp(g->name, name) == 0)
+			return(g);
+	}
+	if ((g = calloc(1, sizeof(*g))) == NULL)
+		return(NULL);
+	snprintf(g->name, sizeof(g->name), "%s", name);
+	g->active = 1;
+	g->next = guests[h];
+	guests[h] = g;
+	return(g);
+}
+
+/**
+ * get_parm - Take a length prefixed string from a parameter list
+ * @p - Current position, advanced past the string
+ * @end - End of the parameter list
+ * @parm - Returned string
+ * @lParm - Size of parm
+ *
+ */
+static int
+get_parm(const char **p, const char *end, char *parm, size_t lParm)
+{
+	int32_t	len;
+
+	if (end - *p < (ptrdiff_t) sizeof(len))
+		return(-1);
+	memcpy(&len, *p, sizeof(len));
+	*p += sizeof(len);
+	if ((len < 0) || (end - *p < len))
+		return(-1);
+	memset(parm, 0, lParm);
+	memcpy(parm, *p, MIN((size_t) len, lParm - 1));
+	*p += len;
+	return(0);
+}
+
+/**
+ * execute - Work out the result of a request
+ * @smapid - Server settings
+ * @fName - SMAPI function name
+ * @target - Target image
+ * @out - Returned rc and reason
+ *
+ */
+static void
+execute(smapid_t *smapid, const char *fName, const char *target, smapiOutHeader_t *out)
+{
+	guest_t	*g;
+	int	i;
+
+	out->rc = 0;
+	out->reason = 0;
+
+	for (i = 0; i < smapid->nScripts; i++) {
+		if ((strcmp(smapid->scripts[i].fName, fName) == 0) &&
+		    ((smapid->scripts[i].target[0] == 0) ||
+		     (strcmp(smapid->scripts[i].target, target) == 0))) {
+			out->rc = smapid->scripts[i].rc;
+			out->reason = smapid->scripts[i].reason;
+			return;
+		}
+	}
+
+	if ((g = get_guest(target)) == NULL) {
+		out->rc = RCERR_INTERNAL;
+		return;
+	}
+	if ((g->inactiveAt != 0) && (now_ms() >= g->inactiveAt)) {
+		g->active = 0;
+		g->inactiveAt = 0;
+	}
+
+	if (strcmp(fName, Image_Status_Query) == 0) {
+		if (!g->active) {
+			out->rc = RCERR_IMAGEOP;
+			out->reason = RS_NOT_ACTIVE;
+		}
+	} else if (strcmp(fName, Image_Deactivate) == 0) {
+		if (g->inactiveAt != 0) {
+			out->rc = RCERR_IMAGEOP;
+			out->reason = RS_BEING_DEACT;
+		} else if (!g->active) {
+			out->rc = RCERR_IMAGEOP;
+			out->reason = RS_NOT_ACTIVE;
+		} else if (smapid->deactTime > 0) {
+			g->inactiveAt = now_ms() + smapid->deactTime;
+		} else {
+			g->active = 0;
+		}
+	} else if (strcmp(fName, Image_Activate) == 0) {
+		if (g->active) {
+			out->rc = RCERR_IMAGEOP;
+			out->reason = RS_ALREADY_ACTIVE;
+		} else {
+			g->active = 1;
+		}
+	} else if (strcmp(fName, Image_Recycle) == 0) {
+		if (!g->active) {
+			out->rc = RCERR_IMAGEOP;
+			out->reason = RS_NOT_ACTIVE;
+		}
+	} else {
+		out->rc = RCERR_SYNTAX;
+		out->reason = RS_FUNCTIONNAME;
+	}
+}
+
+/**
+ * respond - Build the request id and response for a complete request
+ * @smapid - Server settings
+ * @conn - Connection
+ *
+ */
+static int
+respond(smapid_t *smapid, conn_t *conn)
+{
+	const char *p = conn->in + sizeof(int32_t),
+		*end = conn->in + conn->lIn;
+	char	fName[64],
+		user[9],
+		pass[9],
+		target[9];
+	smapiOutHeader_t out;
+	uint32_t reqId = htonl(++reqIds);
+
+	if ((get_parm(&p, end, fName, sizeof(fName)) == -1) ||
+	    (get_parm(&p, end, user, sizeof(user)) == -1) ||
+	    (get_parm(&p, end, pass, sizeof(pass)) == -1) ||
+	    (get_parm(&p, end, target, sizeof(target)) == -1)) {
+		fprintf(stderr, "Malformed request of %d bytes\n", conn->lIn);
+		return(-1);
+	}
+	execute(smapid, fName, target, &out);
+	if (smapid->verbose)
+		fprintf(stderr, "%u %s %s -> %u,%u\n", reqIds, fName, target,
+			out.rc, out.reason);
+
+	conn->lOut = sizeof(reqId) + sizeof(out) + smapid->pad;
+	if ((conn->out = calloc(1, conn->lOut)) == NULL)
+		return(-1);
+	out.outLen = htonl(conn->lOut - sizeof(reqId) - sizeof(out.outLen));
+	out.reqId = reqId;
+	out.rc = htonl(out.rc);
+	out.reason = htonl(out.reason);
+	memcpy(conn->out, &reqId, sizeof(reqId));
+	memcpy(conn->out + sizeof(reqId), &out, sizeof(out));
+
+	conn->offOut = 0;
+	conn->markOut = sizeof(reqId);
+	conn->due = now_ms() + smapid->idDelay;
+	return(0);
+}
+
+/**
+ * conn_close - Drop a connection
+ * @conn - Connection
+ *
+ */
+static void
+conn_close(conn_t *conn)
+{
+	int	i;
+
+	for (i = 0; i < MAX_CONNS; i++) {
+		if (conns[i] == conn) {
+			conns[i] = NULL;
+			break;
+		}
+	}
+	close(conn->sd);
+	free(conn->out);
+	free(conn);
+}
+
+/**
+ * conn_read - Take in as much of the request as has arrived
+ * @smapid - Server settings
+ * @conn - Connection
+ *
+ */
+static int
+conn_read(smapid_t *smapid, conn_t *conn)
+{
+	int32_t	lPlist;
+	ssize_t	n;
+
+	while (conn->out == NULL) {
+		n = recv(conn->sd, conn->in + conn->lIn, sizeof(conn->in) - conn->lIn,
+			 MSG_DONTWAIT);
+		if (n == 0)
+			return(-1);
+		if (n == -1)
+			return(((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1);
+		conn->lIn += n;
+		if (conn->lIn < (int32_t) sizeof(lPlist))
+			continue;
+		memcpy(&lPlist, conn->in, sizeof(lPlist));
+		if ((lPlist < 0) || (lPlist > (int32_t) (sizeof(conn->in) - sizeof(lPlist)))) {
+			fprintf(stderr, "Request length %d out of range\n", lPlist);
+			return(-1);
+		}
+		if (conn->lIn >= (int32_t) sizeof(lPlist) + lPlist) {
+			conn->lIn = sizeof(lPlist) + lPlist;
+			return(respond(smapid, conn));
+		}
+	}
+	return(0);
+}
+
+/**
+ * conn_write - Write what is due of the request id and response
+ * @smapid - Server settings
+ * @conn - Connection
+ * @now - Current time
+ *
+ * Returns 1 when the response is complete
+ */
+static int
+conn_write(smapid_t *smapid, conn_t *conn, int64_t now)
+{
+	int32_t	len;
+	ssize_t	n;
+
+	while ((conn->due != 0) && (now >= conn->due)) {
+		len = conn->markOut - conn->offOut;
+		if (smapid->chunk > 0)
+			len = MIN(len, smapid->chunk);
+		n = send(conn->sd, conn->out + conn->offOut, len,
+			 MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n == -1)
+			return(((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1);
+		conn->offOut += n;
+		if (conn->offOut == conn->lOut)
+			return(1);
+		if (conn->offOut == conn->markOut) {
+			/*
+			 * The request id is out, the response follows
+			 */
+			conn->markOut = conn->lOut;
+			conn->due = now + smapid->rspDelay;
+		} else if (smapid->chunk > 0) {
+			conn->due = now + smapid->chunkWait;
+		}
+	}
+	return(0);
+}
+
+/**
+ * open_listener - Listen on the address and port of the server
+ * @smapid - Server settings
+ *
+ */
+static int
+open_listener(smapid_t *smapid)
+{
+	struct addrinfo hints, *ai;
+	int	sd = -1,
+		on = 1,
+		rc;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags    = AI_PASSIVE;
+	if ((rc = getaddrinfo(smapid->addr, smapid->port, &hints, &ai)) != 0) {
+		fprintf(stderr, "Error resolving %s: %s\n", smapid->addr, gai_strerror(rc));
+		return(-1);
+	}
+	if ((sd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+		perror("socket");
+	} else if ((setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1) ||
+		   (bind(sd, ai->ai_addr, ai->ai_addrlen) == -1) ||
+		   (listen(sd, SOMAXCONN) == -1)) {
+		fprintf(stderr, "Error listening on %s port %s - %s\n",
+			smapid->addr, smapid->port, strerror(errno));
+		close(sd);
+		sd = -1;
+	}
+	freeaddrinfo(ai);
+	return(sd);
+}
+
+/**
+ * serve - Accept and answer requests until told to stop
+ * @smapid - Server settings
+ * @lsd - Listening socket
+ *
+ */
+static int
+serve(smapid_t *smapid, int lsd)
+{
+	struct epoll_event ev, events[64];
+	sigset_t block,
+		 unblock;
+	conn_t	*conn;
+	int64_t	now,
+		wait;
+	int	epfd,
+		sd,
+		slot,
+		n,
+		i;
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		perror("epoll_create1");
+		return(1);
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	(void) epoll_ctl(epfd, EPOLL_CTL_ADD, lsd, &ev);
+
+	/*
+	 * Only let a stop signal in while waiting so it cannot slip
+	 * between the test of stop and an unbounded wait
+	 */
+	sigemptyset(&block);
+	sigaddset(&block, SIGTERM);
+	sigaddset(&block, SIGINT);
+	(void) sigprocmask(SIG_BLOCK, &block, &unblock);
+	sigdelset(&unblock, SIGTERM);
+	sigdelset(&unblock, SIGINT);
+
+	while (!stop) {
+		/*
+		 * Sleep no longer than until the next write falls due
+		 */
+		now = now_ms();
+		wait = -1;
+		for (i = 0; i < MAX_CONNS; i++) {
+			if ((conns[i] != NULL) && (conns[i]->due != 0)) {
+				if (conn_write(smapid, conns[i], now) != 0) {
+					conn_close(conns[i]);
+					continue;
+				}
+				if ((wait == -1) || (conns[i]->due - now < wait))
+					wait = MAX(conns[i]->due - now, 0);
+			}
+		}
+
+		n = epoll_pwait(epfd, events, 64, (int) MIN(wait, INT_MAX), &unblock);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_pwait");
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == NULL) {
+				while ((sd = accept4(lsd, NULL, NULL,
+						     SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+					for (slot = 0; (slot < MAX_CONNS) && (conns[slot] != NULL); slot++)
+						;
+					if ((slot == MAX_CONNS) ||
+					    ((conn = calloc(1, sizeof(*conn))) == NULL)) {
+						close(sd);
+						continue;
+					}
+					conn->sd = sd;
+					conns[slot] = conn;
+					ev.events = EPOLLIN;
+					ev.data.ptr = conn;
+					(void) epoll_ctl(epfd, EPOLL_CTL_ADD, sd, &ev);
+				}
+				continue;
+			}
+			conn = events[i].data.ptr;
+			if (conn->out == NULL) {
+				if (conn_read(smapid, conn) == -1)
+					conn_close(conn);
+				else if (conn->out != NULL)
+					(void) epoll_ctl(epfd, EPOLL_CTL_DEL, conn->sd, NULL);
+			}
+		}
+	}
+	close(epfd);
+	return(0);
+}
+
+/**
+ * get_script - Parse a scripted result
+ * @smapid - Server settings
+ * @arg - [target/]function=rc,reason
+ *
+ */
+static int
+get_script(smapid_t *smapid, const char *arg)
+{
+	script_t *s;
+	const char *slash,
+		*eq;
+	int	lName;
+
+	if (smapid->nScripts == MAX_SCRIPTS)
+		return(-1);
+	s = &smapid->scripts[smapid->nScripts];
+	memset(s, 0, sizeof(*s));
+	if ((eq = strchr(arg, '=')) == NULL)
+		return(-1);
+	if (((slash = strchr(arg, '/')) != NULL) && (slash < eq)) {
+		lName = MIN(slash - arg, (int) sizeof(s->target) - 1);
+		memcpy(s->target, arg, lName);
+		arg = slash + 1;
+	}
+	lName = MIN(eq - arg, (int) sizeof(s->fName) - 1);
+	memcpy(s->fName, arg, lName);
+	if (sscanf(eq + 1, "%u,%u", &s->rc, &s->reason) < 1)
+		return(-1);
+	smapid->nScripts++;
+	return(0);
+}
+
+/**
+ * usage - display command syntax and parameters
+ *
+ */
+static int
+usage(void)
+{
+	fprintf(stderr,"Usage: fence_zvm_smapid [options]\n\n"
+		"\tWhere [options] =\n"
+		"\t-a --address [addr]     - Address to listen on (default: %s)\n"
+		"\t-p --port [port]        - Port to listen on (default: %s)\n"
+		"\t-i --id-delay [ms]      - Delay before the request id\n"
+		"\t-d --delay [ms]         - Delay before the response\n"
+		"\t-x --deactivate [ms]    - Time a deactivation takes to complete\n"
+		"\t-c --chunk [bytes]      - Write the reply in pieces of this size\n"
+		"\t-w --chunk-wait [ms]    - Delay between the pieces\n"
+		"\t-P --pad [bytes]        - Bytes of data after each response header\n"
+		"\t-r --result [spec]      - Result of a function, as\n"
+		"\t                          [target/]function=rc[,reason]\n"
+		"\t-v --verbose            - Log each request on stderr\n"
+		"\t-h --help               - Display this usage information\n",
+		DEFAULT_ADDR, ZVM_DEFAULT_PORT);
+	return(1);
+}
+
+/**
+ * on_signal - Stop serving
+ * @sig - Signal number
+ *
+ */
+static void
+on_signal(int sig)
+{
+	(void) sig;
+	stop = 1;
+}
+
+int
+main(int argc, char **argv)
+{
+	smapid_t smapid;
+	struct sigaction sa;
+	int	c,
+		lsd,
+		rc;
+
+	memset(&smapid, 0, sizeof(smapid));
+	smapid.addr = DEFAULT_ADDR;
+	smapid.port = ZVM_DEFAULT_PORT;
+
+	while ((c = getopt_long(argc, argv, optString, longopts, NULL)) != -1) {
+		switch (c) {
+		case 'a' :
+			smapid.addr = optarg;
+			break;
+		case 'p' :
+			smapid.port = optarg;
+			break;
+		case 'i' :
+			smapid.idDelay = atoi(optarg);
+			break;
+		case 'd' :
+			smapid.rspDelay = atoi(optarg);
+			break;
+		case 'x' :
+			smapid.deactTime = atoi(optarg);
+			break;
+		case 'c' :
+			smapid.chunk = atoi(optarg);
+			break;
+		case 'w' :
+			smapid.chunkWait = atoi(optarg);
+			break;
+		case 'P' :
+			smapid.pad = atoi(optarg);
+			break;
+		case 'r' :
+			if (get_script(&smapid, optarg) == -1) {
+				fprintf(stderr, "Invalid result %s\n", optarg);
+				return(1);
+			}
+			break;
+		case 'v' :
+			smapid.verbose = 1;
+			break;
+		default :
+			return(usage());
+		}
+	}
+
+	if ((lsd = open_listener(&smapid)) == -1)
+		return(1);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	(void) sigaction(SIGTERM, &sa, NULL);
+	(void) sigaction(SIGINT, &sa, NULL);
+
+	rc = serve(&smapid, lsd);
+	close(lsd);
+	return(rc);
+}
@@ -0,0 +1,390 @@
+/*
+ * fence_zvmip_bench.c: Latency and throughput benchmark for fence_zvmip
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Starts fence_zvm_smapid on the loopback interface and runs fence_zvmip
+ * against it a number of times, keeping a number of agents in flight.
+ * Each run fences guests that have not been seen before, one or a list of
+ * them, so every "off" finds its guest active. The time each agent takes
+ * from exec to exit is collected and reported as percentiles along with
+ * the throughput in guests per second.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_AGENT	"./fence_zvmip"
+#define DEFAULT_SERVER	"./fence_zvm_smapid"
+#define DEFAULT_PORT	17444
+#define DEFAULT_RUNS	100
+#define DEFAULT_ACTION	"reboot"
+#define MAX_AGENTS	256
+#define MAX_GUESTS	64
+
+typedef struct {
+	const char *agent;
+	const char *server;
+	const char *action;
+	int	 port;
+	int	 runs;			/* Agent invocations */
+	int	 agents;		/* Invocations in flight */
+	int	 guests;		/* Guests per invocation */
+	int	 concurrency;		/* --concurrency of each invocation */
+	int	 delay;			/* Server response delay in ms */
+	int	 deactTime;		/* Server deactivation time in ms */
+	int	 verbose;
+} bench_t;
+
+typedef struct {
+	pid_t	 pid;
+	int64_t	 start;
+} running_t;
+
+static struct option longopts[] = {
+	{"agent",	required_argument,	NULL, 'a'},
+	{"server",	required_argument,	NULL, 's'},
+	{"action",	required_argument,	NULL, 'o'},
+	{"port",	required_argument,	NULL, 'p'},
+	{"runs",	required_argument,	NULL, 'N'},
+	{"agents",	required_argument,	NULL, 'j'},
+	{"guests",	required_argument,	NULL, 'g'},
+	{"concurrency",	required_argument,	NULL, 'c'},
+	{"delay",	required_argument,	NULL, 'd'},
+	{"deactivate",	required_argument,	NULL, 'x'},
+	{"verbose",	no_argument,		NULL, 'v'},
+	{"help",	no_argument,		NULL, 'h'},
+	{NULL,		0,			NULL, 0}
+};
+
+static const char *optString = "a:s:o:p:N:j:g:c:d:x:vh";
+
+/**
+ * now_us - Microseconds on the monotonic clock
+ *
+ */
+static int64_t
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/**
+ * cmp_latency - Order latencies for the percentiles
+ *
+ */
+static int
+cmp_latency(const void *a, const void *b)
+{
+	int64_t	x = *(const int64_t *) a,
+		y = *(const int64_t *) b;
+
+	return((x > y) - (x < y));
+}
+
+/**
+ * start_server - Run the stand-in server and wait until it accepts
+ * @bench - Benchmark settings
+ *
+ */
+static pid_t
+start_server(bench_t *bench)
+{
+	struct sockaddr_in sin;
+	char	port[16],
+		delay[16],
+		deact[16];
+	pid_t	pid;
+	int	sd,
+		i;
+
+	snprintf(port, sizeof(port), "%d", bench->port);
+	snprintf(delay, sizeof(delay), "%d", bench->delay);
+	snprintf(deact, sizeof(deact), "%d", bench->deactTime);
+
+	if ((pid = fork()) == 0) {
+		execl(bench->server, bench->server, "-a", "127.0.0.1", "-p", port,
+		      "-d", delay, "-x", deact, bench->verbose ? "-v" : NULL, NULL);
+		fprintf(stderr, "Cannot run %s - %s\n", bench->server, strerror(errno));
+		_exit(127);
+	}
+	if (pid == -1)
+		return(-1);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(bench->port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	for (i = 0; i < 200; i++) {
+		if ((sd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+			break;
+		if (connect(sd, (struct sockaddr *) &sin, sizeof(sin)) == 0) {
+			close(sd);
+			return(pid);
+		}
+		close(sd);
+		if (waitpid(pid, NULL, WNOHANG) == pid)
+			return(-1);
+		usleep(10000);
+	}
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	return(-1);
+}
+
+/**
+ * start_agent - Run one fence_zvmip on the next guests
+ * @bench - Benchmark settings
+ * @run - Number of the invocation
+ *
+ */
+static pid_t
+start_agent(bench_t *bench, int run)
+{
+	char	port[16],
+		conc[16],
+		timeout[16],
+		plug[MAX_GUESTS * 9];
+	size_t	lPlug = 0;
+	pid_t	pid;
+	int	fd,
+		i;
+
+	for (i = 0; i < bench->guests; i++)
+		lPlug += snprintf(plug + lPlug, sizeof(plug) - lPlug, "%sB%07d",
+				  (i == 0) ? "" : ",", run * bench->guests + i);
+	snprintf(port, sizeof(port), "%d", bench->port);
+	snprintf(conc, sizeof(conc), "%d", bench->concurrency);
+	snprintf(timeout, sizeof(timeout), "%d", 60);
+
+	if ((pid = fork()) == 0) {
+		if (!bench->verbose && ((fd = open("/dev/null", O_WRONLY)) != -1)) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			close(fd);
+		}
+		execl(bench->agent, bench->agent, "-a", "127.0.0.1", "--ipport", port,
+		      "-u", "BENCH", "-p", "BENCH", "-o", bench->action, "-n", plug,
+		      "-c", conc, "-t", timeout, NULL);
+		_exit(127);
+	}
+	return(pid);
+}
+
+/**
+ * run - Keep the agents in flight until all invocations are done
+ * @bench - Benchmark settings
+ *
+ */
+static int
+run(bench_t *bench)
+{
+	running_t running[MAX_AGENTS];
+	struct rusage ru;
+	int64_t	*latency,
+		start,
+		wall,
+		end;
+	pid_t	server,
+		pid;
+	int	started = 0,
+		done = 0,
+		failed = 0,
+		inFlight = 0,
+		status,
+		i;
+
+	memset(running, 0, sizeof(running));
+	if ((latency = calloc(bench->runs, sizeof(*latency))) == NULL)
+		return(1);
+	if ((server = start_server(bench)) == -1) {
+		fprintf(stderr, "SMAPI stand-in server did not start\n");
+		free(latency);
+		return(1);
+	}
+
+	start = now_us();
+	while (done < bench->runs) {
+		while ((inFlight < bench->agents) && (started < bench->runs)) {
+			for (i = 0; (i < bench->agents) && (running[i].pid != 0); i++)
+				;
+			running[i].start = now_us();
+			if ((running[i].pid = start_agent(bench, started)) == -1) {
+				perror("fork");
+				running[i].pid = 0;
+				break;
+			}
+			started++;
+			inFlight++;
+		}
+		if (inFlight == 0)
+			break;
+
+		if ((pid = waitpid(-1, &status, 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		end = now_us();
+		for (i = 0; i < bench->agents; i++) {
+			if (running[i].pid == pid) {
+				latency[done++] = end - running[i].start;
+				running[i].pid = 0;
+				inFlight--;
+				if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+					failed++;
+				break;
+			}
+		}
+	}
+	wall = now_us() - start;
+
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	getrusage(RUSAGE_CHILDREN, &ru);
+
+	qsort(latency, done, sizeof(*latency), cmp_latency);
+	printf("%d runs of \"%s\" on %d guest(s), %d in flight, server delay %d ms\n",
+	       done, bench->action, bench->guests, bench->agents, bench->delay);
+	printf("failed:      %d\n", failed);
+	if (done > 0) {
+		printf("latency ms:  p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n",
+		       latency[done / 2] / 1000.0,
+		       latency[(done * 90) / 100] / 1000.0,
+		       latency[(done * 99) / 100] / 1000.0,
+		       latency[done - 1] / 1000.0);
+		printf("throughput:  %.1f guests/s over %.2f s\n",
+		       (double) done * bench->guests * 1000000 / wall, wall / 1000000.0);
+	}
+	printf("cpu:         %.2f s user  %.2f s system (agents and server)\n",
+	       ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0,
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0);
+
+	free(latency);
+	return(failed != 0);
+}
+
+/**
+ * usage - display command syntax and parameters
+ *
+ */
+static int
+usage(void)
+{
+	fprintf(stderr,"Usage: fence_zvmip_bench [options]\n\n"
+		"\tWhere [options] =\n"
+		"\t-a --agent [path]       - Agent to run (default: %s)\n"
+		"\t-s --server [path]      - Stand-in server (default: %s)\n"
+		"\t-o --action [action]    - Action of each run (default: %s)\n"
+		"\t-p --port [port]        - Port of the server (default: %d)\n"
+		"\t-N --runs [n]           - Agent invocations (default: %d)\n"
+		"\t-j --agents [n]         - Invocations in flight (default: 1)\n"
+		"\t-g --guests [n]         - Guests fenced by each invocation (default: 1)\n"
+		"\t-c --concurrency [n]    - Connections of each invocation (default: 8)\n"
+		"\t-d --delay [ms]         - Server response delay (default: 0)\n"
+		"\t-x --deactivate [ms]    - Server deactivation time (default: 0)\n"
+		"\t-v --verbose            - Show the output of server and agents\n"
+		"\t-h --help               - Display this usage information\n",
+		DEFAULT_AGENT, DEFAULT_SERVER, DEFAULT_ACTION, DEFAULT_PORT,
+		DEFAULT_RUNS);
+	return(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	bench_t	bench;
+	int	c;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.agent = DEFAULT_AGENT;
+	bench.server = DEFAULT_SERVER;
+	bench.action = DEFAULT_ACTION;
+	bench.port = DEFAULT_PORT;
+	bench.runs = DEFAULT_RUNS;
+	bench.agents = 1;
+	bench.guests = 1;
+	bench.concurrency = 8;
+
+	while ((c = getopt_long(argc, argv, optString, longopts, NULL)) != -1) {
+		switch (c) {
+		case 'a' :
+			bench.agent = optarg;
+			break;
+		case 's' :
+			bench.server = optarg;
+			break;
+		case 'o' :
+			bench.action = optarg;
+			break;
+		case 'p' :
+			bench.port = atoi(optarg);
+			break;
+		case 'N' :
+			bench.runs = atoi(optarg);
+			break;
+		case 'j' :
+			bench.agents = atoi(optarg);
+			break;
+		case 'g' :
+			bench.guests = atoi(optarg);
+			break;
+		case 'c' :
+			bench.concurrency = atoi(optarg);
+			break;
+		case 'd' :
+			bench.delay = atoi(optarg);
+			break;
+		case 'x' :
+			bench.deactTime = atoi(optarg);
+			break;
+		case 'v' :
+			bench.verbose = 1;
+			break;
+		default :
+			return(usage());
+		}
+	}
+
+	if ((bench.runs < 1) || (bench.agents < 1) || (bench.agents > MAX_AGENTS) ||
+	    (bench.guests < 1) || (bench.guests > MAX_GUESTS) || (bench.concurrency < 1)) {
+		fprintf(stderr, "Runs, agents (at most %d), guests (at most %d) and "
+			"concurrency must be positive\n", MAX_AGENTS, MAX_GUESTS);
+		return(1);
+	}
+
+	return(run(&bench));
+}
@@ -7,6 +7,7 @@ $(TARGET): $(SRC)
 		-e 's#@''FENCEAGENTSLIBDIR@#${FENCEAGENTSLIBDIR}#g' \
 		-e 's#@''SNMPBIN@#${SNMPBIN}#g' \
 		-e 's#@''LOGDIR@#${LOGDIR}#g' \
+		-e 's#@''CLUSTERVARRUN@#${CLUSTERVARRUN}#g' \
 		-e 's#@''SBINDIR@#${sbindir}#g' \
 		-e 's#@''LIBEXECDIR@#${libexecdir}#g' \
 		-e 's#@''IPMITOOL_PATH@#${IPMITOOL_PATH}#g' \